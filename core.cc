@@ -8,9 +8,20 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <cmath>
+#include <ctime>
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <png.h>
 #include <libgen.h>
 #include <json-c/json.h>
@@ -189,7 +200,7 @@ template <typename T> void Die(T arg) {
 
 PDB::Ptr PDB::New(char *filename, uint8_t density) { return PDB::Ptr(new PDB(filename, density)); }
 
-PDB::PDB(char *filename, uint8_t dens) : density(dens) {
+PDB::PDB(char *filename, uint8_t dens) : density(dens), coarse(false) {
   handle = plugin.open_file_read(filename, "pdb", &natoms);
   if (!handle) Die("<VMDPLUGIN> open_file_read(\"%s\") failed.", filename);
   atoms = new molfile_atom_t[natoms];
@@ -205,6 +216,55 @@ PDB::~PDB() {
   delete[] ts.coords; 
 }
 
+// Reads the next model of a multi-model file over the current coordinates,
+// leaving the span of the first one in place.
+bool PDB::NextFrame() {
+  if (coarse) Die("Cannot read further frames of a coarse-grained structure");
+  return plugin.read_next_timestep(handle, natoms, &ts) == MOLFILE_SUCCESS;
+}
+
+static bool SameResidue(const molfile_atom_t &a, const molfile_atom_t &b) {
+  return a.resid == b.resid && !strcmp(a.chain, b.chain) && !strcmp(a.segid, b.segid) && !strcmp(a.insertion, b.insertion);
+}
+
+// Collapses each residue, or each run of every atoms when every is positive,
+// into one bead at its center of mass. The bead radius is that of a sphere
+// with the summed van der Waals volume of its atoms.
+void PDB::CoarseGrain(int every) {
+  if (coarse) return;
+  vector<molfile_atom_t> beads;
+  vector<float> centers;
+  for (int start = 0, end; start < natoms; start = end) {
+    for (end = start + 1; end < natoms; ++end) {
+      if (every > 0 ? end - start >= every : !SameResidue(atoms[start], atoms[end])) break;
+    }
+    double mass = 0, volume = 0, center[3] = { 0, 0, 0 };
+    for (int l = start; l < end; ++l) {
+      double m = (optflags & MOLFILE_MASS) ? atoms[l].mass : get_pte_mass(atoms[l].atomicnumber);
+      if (m <= 0) m = 1;
+      for (int c = 0; c < 3; ++c) center[c] += m*ts.coords[l*3 + c];
+      mass += m;
+      volume += pow(get_pte_vdw_radius(atoms[l].atomicnumber), 3);
+    }
+    molfile_atom_t bead = atoms[start];
+    strcpy(bead.name, "CG");
+    strcpy(bead.type, "CG");
+    bead.mass = mass;
+    bead.radius = cbrt(volume);
+    beads.push_back(bead);
+    for (int c = 0; c < 3; ++c) centers.push_back(center[c]/mass);
+  }
+  delete[] atoms;
+  delete[] ts.coords;
+  natoms = beads.size();
+  atoms = new molfile_atom_t[natoms];
+  ts.coords = new float[natoms*3];
+  copy(beads.begin(), beads.end(), atoms);
+  copy(centers.begin(), centers.end(), ts.coords);
+  triple_min_max(ts.coords, natoms, &xmin, &xmax, &ymin, &ymax, &zmin, &zmax);
+  coarse = true;
+}
+
 void MultiPDBVoxelizer::SetRadius(double r) {
   radius = r;
   vradius = step*r;
@@ -215,8 +275,17 @@ void MultiPDBVoxelizer::SetRadius(double r) {
   zoffset += r*3;
 }
 
-void MultiPDBVoxelizer::SetDimensions(int i, int j, int k) { x = i, y = j, z = k, v = x*y*z, a = x*y; }
+void MultiPDBVoxelizer::SetDimensions(int i, int j, int k) { x = i, y = j, z = k, v = (size_t) x*y*z, a = (size_t) x*y; }
 void MultiPDBVoxelizer::push_back(PDB::Ptr p) { pdbs.push_back(p); }
+
+// Advances every structure to its next frame, keeping the grid placement of
+// the first; false once any of them has run out.
+bool MultiPDBVoxelizer::NextFrame() {
+  for (auto it = pdbs.begin(); it != pdbs.end(); it++) {
+    if (!(*it)->NextFrame()) return false;
+  }
+  return true;
+}
 void MultiPDBVoxelizer::CalculateSpan() {
   xmin = numeric_limits<float>::max();
   ymin = numeric_limits<float>::max();
@@ -251,70 +320,636 @@ void MultiPDBVoxelizer::CalculateSpan() {
   zoffset = xdiff*(1 - zratio)*step/2;
 }
 
-PNG<PNG_FORMAT_GA>::Pixel *MultiPDBVoxelizer::Voxelize() {
-  int density = 0, maxdens = 0, i, j, k, l;
+bool MultiPDBVoxelizer::Covers(PDB *p, int l, int i, int j, int k) {
   double mincoords[3];
   double maxcoords[3];
   double center[3];
   double centercoords[3];
-  PDB *winner = nullptr;
+  center[0] = p->ts.coords[l*3];
+  center[1] = p->ts.coords[l*3 + 1];
+  center[2] = p->ts.coords[l*3 + 2];
+  mincoords[0] = xadj + (double) (i - xoffset)*step;
+  centercoords[0] = mincoords[0] + step/2;
+  maxcoords[0] = mincoords[0] + step;
+  mincoords[1] = yadj + (double) (j - yoffset)*step;
+  centercoords[1] = mincoords[1] + step/2;
+  maxcoords[1] = mincoords[1] + step;
+  mincoords[2] = zadj + (double) (k - zoffset)*step;
+  centercoords[2] = mincoords[2] + step/2;
+  maxcoords[2] = mincoords[2] + step;
+  return (center[0] >= mincoords[0] &&
+    center[0] < maxcoords[0] &&
+    center[1] >= mincoords[1] &&
+    center[1] < maxcoords[1] &&
+    center[2] >= mincoords[2] &&
+    center[2] < maxcoords[2]) || 
+    InSphere(centercoords[0], center[0], centercoords[1], center[1], centercoords[2], center[2], vradius*p->Radius(l));
+}
+
+// Resolves the grid in x slabs of at most VOXELIZE_SLAB_VOXELS voxels, so
+// the label and count scratch stays bounded and only the returned pixels
+// scale with the grid.
+PNG<PNG_FORMAT_GA>::Pixel *MultiPDBVoxelizer::Voxelize() {
   PNG<PNG_FORMAT_GA>::Pixel *retval = new PNG<PNG_FORMAT_GA>::Pixel[v];
-  for (i = 0; i < x; ++i) {
-    for (j = 0; j < y; ++j) {
-      for (k = 0; k < z; ++k) {
-        winner = nullptr;
-        maxdens = 0;
-        for (auto it = pdbs.begin(); it != pdbs.end(); it++) {
-          density = 0;
-          for (l = 0; l < (*it)->natoms; l++) {
-            center[0] = (*it)->ts.coords[l*3];
-            center[1] = (*it)->ts.coords[l*3 + 1];
-            center[2] = (*it)->ts.coords[l*3 + 2];
-            mincoords[0] = xadj + (double) (i - xoffset)*step;
-            centercoords[0] = mincoords[0] + step/2;
-            maxcoords[0] = mincoords[0] + step;
-            mincoords[1] = yadj + (double) (j - yoffset)*step;
-            centercoords[1] = mincoords[1] + step/2;
-            maxcoords[1] = mincoords[1] + step;
-            mincoords[2] = zadj + (double) (k - zoffset)*step;
-            centercoords[2] = mincoords[2] + step/2;
-            maxcoords[2] = mincoords[2] + step;
-            if ((center[0] >= mincoords[0] &&
-              center[0] < maxcoords[0] &&
-              center[1] >= mincoords[1] &&
-              center[1] < maxcoords[1] &&
-              center[2] >= mincoords[2] &&
-              center[2] < maxcoords[2]) || 
-              InSphere(centercoords[0], center[0], centercoords[1], center[1], centercoords[2], center[2], vradius*get_pte_vdw_radius((*it)->atoms[l].atomicnumber))) {
-              ++density;
-            }
-          }
-          if (density > maxdens) {
-            maxdens = density;
-            winner = it->get();
+  if (!v) return retval;
+  int thickness = (int) max((size_t) 1, min((size_t) x, VOXELIZE_SLAB_VOXELS/a));
+  int nslabs = (x + thickness - 1)/thickness;
+  vector<vector<pair<uint32_t, uint32_t>>> routes(nslabs);
+  int lo[3], hi[3];
+  for (size_t p = 0; p < pdbs.size(); ++p) {
+    for (int l = 0; l < pdbs[p]->natoms; ++l) {
+      if (!AtomBounds(pdbs[p].get(), l, lo, hi)) continue;
+      for (int s = lo[0]/thickness; s <= hi[0]/thickness; ++s) routes[s].push_back(pair<uint32_t, uint32_t>(p, l));
+    }
+  }
+  for (int s = 0; s < nslabs; ++s) {
+    int slo[3] = { s*thickness, 0, 0 }, shi[3] = { min(x, (s + 1)*thickness) - 1, y - 1, z - 1 };
+    VoxelizeBrick(retval, routes[s], slo, shi);
+    vector<pair<uint32_t, uint32_t>>().swap(routes[s]);
+  }
+  return retval;
+}
+
+LabelVolume::Ptr MultiPDBVoxelizer::VoxelizeLabels() {
+  if (pdbs.size() >= numeric_limits<LabelVolume::Label>::max()) Die("Cannot label more than %d structures", (int) numeric_limits<LabelVolume::Label>::max() - 1);
+  LabelVolume::Ptr retval = LabelVolume::New(x, y, z);
+  retval->palette.push_back(0);
+  vector<pair<uint32_t, uint32_t>> atoms;
+  for (size_t p = 0; p < pdbs.size(); ++p) {
+    retval->palette.push_back(pdbs[p]->density);
+    for (int l = 0; l < pdbs[p]->natoms; ++l) atoms.push_back(pair<uint32_t, uint32_t>(p, l));
+  }
+  int lo[3] = { 0, 0, 0 }, hi[3] = { x - 1, y - 1, z - 1 };
+  if (v) ResolveLabels(&retval->labels[0], atoms, lo, hi);
+  return retval;
+}
+
+// Conservative voxel index box of everything Covers() can accept for atom l,
+// padded by one voxel so rounding never drops a boundary voxel. Returns false
+// when the box misses the grid entirely.
+bool MultiPDBVoxelizer::AtomBounds(PDB *p, int l, int *lo, int *hi) {
+  double adj[3] = { xadj, yadj, zadj };
+  int offset[3] = { xoffset, yoffset, zoffset };
+  int dims[3] = { x, y, z };
+  double r = vradius*p->Radius(l);
+  for (int m = 0; m < 3; ++m) {
+    double c = p->ts.coords[l*3 + m];
+    double cell = floor((c - adj[m])/step) + offset[m];
+    double first = min(floor((c - r - adj[m] - step/2)/step) + offset[m], cell) - 1;
+    double last = max(ceil((c + r - adj[m] - step/2)/step) + offset[m], cell) + 1;
+    if (last < 0 || first > dims[m] - 1) return false;
+    lo[m] = first < 0 ? 0 : (int) first;
+    hi[m] = last > dims[m] - 1 ? dims[m] - 1 : (int) last;
+  }
+  return true;
+}
+
+// Picks the winning structure of every voxel in the box [lo, hi] in one
+// scatter pass over atoms, which must be grouped by structure. Each group
+// accumulates into count and is folded into the running argmax as soon as it
+// ends, touching only the voxels it hit, so the cost follows the number of
+// atom/voxel hits rather than structures times voxels. Ties keep the earlier
+// structure. Writes label p + 1 for structure p and 0 for empty voxels. With
+// a channel rule every atom lands in its channel's plane of out instead, and
+// each plane is resolved independently in the same pass.
+void MultiPDBVoxelizer::ResolveLabels(LabelVolume::Label *out, const vector<pair<uint32_t, uint32_t>> &atoms, int *lo, int *hi, ChannelRule *rule) {
+  int by = hi[1] - lo[1] + 1, bz = hi[2] - lo[2] + 1;
+  size_t bv = (size_t) (hi[0] - lo[0] + 1)*by*bz;
+  size_t channels = rule ? rule->names.size() : 1;
+  vector<int> best(bv*channels, 0);
+  vector<int> count(bv*channels, 0);
+  vector<size_t> touched;
+  int alo[3], ahi[3];
+  fill(out, out + bv*channels, 0);
+  for (size_t n = 0; n < atoms.size();) {
+    uint32_t pdb = atoms[n].first;
+    PDB *p = pdbs[pdb].get();
+    for (; n < atoms.size() && atoms[n].first == pdb; ++n) {
+      int l = atoms[n].second;
+      if (!AtomBounds(p, l, alo, ahi)) continue;
+      size_t plane = rule ? rule->Lookup(p->atoms[l])*bv : 0;
+      for (int i = max(alo[0], lo[0]); i <= min(ahi[0], hi[0]); ++i) {
+        for (int j = max(alo[1], lo[1]); j <= min(ahi[1], hi[1]); ++j) {
+          for (int k = max(alo[2], lo[2]); k <= min(ahi[2], hi[2]); ++k) {
+            if (!Covers(p, l, i, j, k)) continue;
+            size_t m = plane + ((size_t) (i - lo[0])*by + (j - lo[1]))*bz + (k - lo[2]);
+            if (!count[m]++) touched.push_back(m);
           }
         }
-        if (!winner) { retval[i*a + j*y + k] = {0, 0}; }
-        else { retval[i*a + j*y + k] = { winner->density, 0xff }; }
+      }
+    }
+    for (auto m : touched) {
+      if (count[m] > best[m]) {
+        best[m] = count[m];
+        out[m] = pdb + 1;
+      }
+      count[m] = 0;
+    }
+    touched.clear();
+  }
+}
+
+void MultiPDBVoxelizer::VoxelizeBrick(PNG<PNG_FORMAT_GA>::Pixel *out, const vector<pair<uint32_t, uint32_t>> &atoms, int *lo, int *hi) {
+  int by = hi[1] - lo[1] + 1, bz = hi[2] - lo[2] + 1;
+  vector<LabelVolume::Label> labels((size_t) (hi[0] - lo[0] + 1)*by*bz);
+  ResolveLabels(&labels[0], atoms, lo, hi);
+  for (int i = lo[0]; i <= hi[0]; ++i) {
+    for (int j = lo[1]; j <= hi[1]; ++j) {
+      for (int k = lo[2]; k <= hi[2]; ++k) {
+        LabelVolume::Label w = labels[((size_t) (i - lo[0])*by + (j - lo[1]))*bz + (k - lo[2])];
+        if (!w) out[(size_t) i*a + (size_t) j*y + k] = {0, 0};
+        else out[(size_t) i*a + (size_t) j*y + k] = { pdbs[w - 1]->density, 0xff };
+      }
+    }
+  }
+}
+
+LabelVolume::Ptr LabelVolume::New(size_t i, size_t j, size_t k) { return LabelVolume::Ptr(new LabelVolume(i, j, k)); }
+
+LabelVolume::LabelVolume(size_t i, size_t j, size_t k) : x(i), y(j), z(k), labels(i*j*k, 0) {}
+
+PNG<PNG_FORMAT_GA>::Pixel *LabelVolume::ToPixels() {
+  PNG<PNG_FORMAT_GA>::Pixel *retval = new PNG<PNG_FORMAT_GA>::Pixel[labels.size()];
+  for (size_t i = 0; i < x; ++i) {
+    for (size_t j = 0; j < y; ++j) {
+      for (size_t k = 0; k < z; ++k) {
+        retval[i*x*y + j*y + k] = GetPixel(i, j, k);
+      }
+    }
+  }
+  return retval;
+}
+
+int LabelVolume::Write(const char *filename) {
+  ofstream out(filename, ios::binary);
+  out.write((const char *) &labels[0], labels.size()*sizeof(Label));
+  out.close();
+  if (!out) return 0;
+  json_object *meta = json_object_new_object();
+  json_object *dimensions = json_object_new_array();
+  json_object_array_add(dimensions, json_object_new_int(x));
+  json_object_array_add(dimensions, json_object_new_int(y));
+  json_object_array_add(dimensions, json_object_new_int(z));
+  json_object_object_add(meta, "dimensions", dimensions);
+  json_object *colors = json_object_new_array();
+  for (auto it = palette.begin(); it != palette.end(); it++) {
+    json_object_array_add(colors, json_object_new_int(*it));
+  }
+  json_object_object_add(meta, "palette", colors);
+  ofstream palette_out(string(filename) + ".json");
+  palette_out << json_object_to_json_string(meta);
+  palette_out.close();
+  json_object_put(meta);
+  return !!palette_out;
+}
+
+ChannelRule::Ptr ChannelRule::New(const char *rule) { return ChannelRule::Ptr(new ChannelRule(rule)); }
+
+ChannelRule::ChannelRule(const char *rule) {
+  if (!strcmp(rule, "element")) {
+    kind = Kind::Element;
+    names = { "C", "N", "O", "S", "other" };
+  } else if (!strcmp(rule, "chain")) kind = Kind::Chain;
+  else if (!strcmp(rule, "residue")) kind = Kind::Residue;
+  else Die("Unknown channel rule \"%s\", expected chain, element or residue", rule);
+}
+
+string ChannelRule::Key(const molfile_atom_t &atom) {
+  if (kind == Kind::Chain) return atom.chain;
+  return atom.resname;
+}
+
+void ChannelRule::Learn(const molfile_atom_t &atom) {
+  if (kind == Kind::Element) return;
+  string key = Key(atom);
+  if (index.find(key) != index.end()) return;
+  index[key] = names.size();
+  names.push_back(key);
+}
+
+size_t ChannelRule::Lookup(const molfile_atom_t &atom) {
+  if (kind == Kind::Element) {
+    switch (atom.atomicnumber) {
+      case 6: return 0;
+      case 7: return 1;
+      case 8: return 2;
+      case 16: return 3;
+      default: return 4;
+    }
+  }
+  return index[Key(atom)];
+}
+
+ChannelVolume::Ptr ChannelVolume::New(size_t i, size_t j, size_t k, size_t c) { return ChannelVolume::Ptr(new ChannelVolume(i, j, k, c)); }
+
+ChannelVolume::ChannelVolume(size_t i, size_t j, size_t k, size_t c) : x(i), y(j), z(k), channels(c), data(i*j*k*c, 0) {}
+
+// Planar output is the channel planes back to back; interleaved output keeps
+// every voxel's channels together. Channel names and layout go to
+// filename.json.
+int ChannelVolume::Write(const char *filename, bool interleaved) {
+  ofstream out(filename, ios::binary);
+  if (!interleaved && !data.empty()) out.write((const char *) &data[0], data.size());
+  else {
+    size_t v = x*y*z;
+    vector<uint8_t> voxel(channels);
+    for (size_t m = 0; m < v; ++m) {
+      for (size_t c = 0; c < channels; ++c) voxel[c] = data[c*v + m];
+      out.write((const char *) &voxel[0], channels);
+    }
+  }
+  out.close();
+  if (!out) return 0;
+  json_object *meta = json_object_new_object();
+  json_object *dimensions = json_object_new_array();
+  json_object_array_add(dimensions, json_object_new_int(x));
+  json_object_array_add(dimensions, json_object_new_int(y));
+  json_object_array_add(dimensions, json_object_new_int(z));
+  json_object_object_add(meta, "dimensions", dimensions);
+  json_object *channel_names = json_object_new_array();
+  for (auto it = names.begin(); it != names.end(); it++) {
+    json_object_array_add(channel_names, json_object_new_string(it->c_str()));
+  }
+  json_object_object_add(meta, "channels", channel_names);
+  json_object_object_add(meta, "layout", json_object_new_string(interleaved ? "interleaved" : "planar"));
+  ofstream meta_out(string(filename) + ".json");
+  meta_out << json_object_to_json_string(meta);
+  meta_out.close();
+  json_object_put(meta);
+  return !!meta_out;
+}
+
+// Voxelizes every channel of rule in one pass. Each plane holds the density
+// of the structure that wins that voxel among the channel's atoms, which is
+// what voxelizing the channel's atoms on their own would produce. Like
+// Voxelize() the grid is resolved in x slabs, here of at most
+// VOXELIZE_SLAB_VOXELS voxels over all channels, so only the returned planes
+// scale with the grid.
+ChannelVolume::Ptr MultiPDBVoxelizer::VoxelizeChannels(ChannelRule::Ptr rule) {
+  if (pdbs.size() >= numeric_limits<LabelVolume::Label>::max()) Die("Cannot label more than %d structures", (int) numeric_limits<LabelVolume::Label>::max() - 1);
+  for (size_t p = 0; p < pdbs.size(); ++p) {
+    for (int l = 0; l < pdbs[p]->natoms; ++l) rule->Learn(pdbs[p]->atoms[l]);
+  }
+  ChannelVolume::Ptr retval = ChannelVolume::New(x, y, z, rule->names.size());
+  retval->names = rule->names;
+  if (!v || retval->data.empty()) return retval;
+  size_t channels = rule->names.size(), plane = (size_t) y*z;
+  int thickness = (int) max((size_t) 1, min((size_t) x, VOXELIZE_SLAB_VOXELS/(plane*channels)));
+  int nslabs = (x + thickness - 1)/thickness;
+  vector<vector<pair<uint32_t, uint32_t>>> routes(nslabs);
+  int lo[3], hi[3];
+  for (size_t p = 0; p < pdbs.size(); ++p) {
+    for (int l = 0; l < pdbs[p]->natoms; ++l) {
+      if (!AtomBounds(pdbs[p].get(), l, lo, hi)) continue;
+      for (int s = lo[0]/thickness; s <= hi[0]/thickness; ++s) routes[s].push_back(pair<uint32_t, uint32_t>(p, l));
+    }
+  }
+  vector<LabelVolume::Label> labels;
+  for (int s = 0; s < nslabs; ++s) {
+    int slo[3] = { s*thickness, 0, 0 }, shi[3] = { min(x, (s + 1)*thickness) - 1, y - 1, z - 1 };
+    size_t bv = (shi[0] - slo[0] + 1)*plane;
+    labels.resize(bv*channels);
+    ResolveLabels(&labels[0], routes[s], slo, shi, rule.get());
+    vector<pair<uint32_t, uint32_t>>().swap(routes[s]);
+    for (size_t c = 0; c < channels; ++c) {
+      uint8_t *out = &retval->data[c*v + slo[0]*plane];
+      for (size_t m = 0; m < bv; ++m) {
+        LabelVolume::Label w = labels[c*bv + m];
+        if (w) out[m] = pdbs[w - 1]->density;
       }
     }
   }
   return retval;
 }
 
+struct BrickProgressHeader {
+  char magic[8];
+  int32_t x, y, z, brick;
+  uint64_t fingerprint;
+};
+
+static const char brick_progress_magic[8] = { 'V', 'O', 'X', 'B', 'R', 'I', 'C', 'K' };
+
+static uint64_t Fnv1a(uint64_t h, const void *data, size_t len) {
+  const uint8_t *bytes = (const uint8_t *) data;
+  for (size_t i = 0; i < len; ++i) h = (h ^ bytes[i])*1099511628211ull;
+  return h;
+}
+
+// Hash of everything a brick's voxels depend on: every atom's coordinates
+// and radius, each structure's density, and the grid placement.
+uint64_t MultiPDBVoxelizer::Fingerprint() {
+  uint64_t h = 14695981039346656037ull;
+  double placement[] = { step, vradius, xadj, yadj, zadj };
+  int offsets[] = { x, y, z, xoffset, yoffset, zoffset };
+  h = Fnv1a(h, placement, sizeof(placement));
+  h = Fnv1a(h, offsets, sizeof(offsets));
+  for (auto it = pdbs.begin(); it != pdbs.end(); it++) {
+    PDB *p = it->get();
+    h = Fnv1a(h, &p->density, sizeof(p->density));
+    h = Fnv1a(h, &p->natoms, sizeof(p->natoms));
+    h = Fnv1a(h, p->ts.coords, p->natoms*3*sizeof(float));
+    for (int l = 0; l < p->natoms; ++l) {
+      float r = p->Radius(l);
+      h = Fnv1a(h, &r, sizeof(r));
+    }
+  }
+  return h;
+}
+
+// Voxelizes the grid brick by brick into a disk-backed volume at filename,
+// laid out exactly like the array returned by Voxelize(). Completed bricks
+// are recorded in filename.bricks once their voxels have been synced, so an
+// interrupted run picks up where it left off; a run over different inputs
+// starts over.
+MappedFile::Ptr MultiPDBVoxelizer::VoxelizeOutOfCore(const char *filename, int brick, int threads) {
+  if (brick <= 0) Die("Brick size must be positive");
+  if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+  int nbricks[3] = { (x + brick - 1)/brick, (y + brick - 1)/brick, (z + brick - 1)/brick };
+  size_t total = (size_t) nbricks[0]*nbricks[1]*nbricks[2];
+  MappedFile::Ptr volume = MappedFile::New(filename, v*sizeof(PNG<PNG_FORMAT_GA>::Pixel));
+  MappedFile::Ptr progress = MappedFile::New((string(filename) + ".bricks").c_str(), sizeof(BrickProgressHeader) + total);
+  BrickProgressHeader *header = (BrickProgressHeader *) progress->GetBuffer();
+  uint8_t *done = (uint8_t *) progress->GetBuffer() + sizeof(BrickProgressHeader);
+  uint64_t fingerprint = Fingerprint();
+  bool resumable = !memcmp(header->magic, brick_progress_magic, sizeof(header->magic)) && header->x == x && header->y == y && header->z == z && header->brick == brick;
+  if (resumable && header->fingerprint != fingerprint) fprintf(stderr, "%s holds a different voxelization, starting over\n", filename);
+  if (volume->WasCreated() || !resumable || header->fingerprint != fingerprint) {
+    memset(done, 0, total);
+    memcpy(header->magic, brick_progress_magic, sizeof(header->magic));
+    header->x = x;
+    header->y = y;
+    header->z = z;
+    header->brick = brick;
+    header->fingerprint = fingerprint;
+    progress->Sync();
+  }
+  vector<vector<pair<uint32_t, uint32_t>>> routes(total);
+  int lo[3], hi[3];
+  for (size_t p = 0; p < pdbs.size(); ++p) {
+    for (int l = 0; l < pdbs[p]->natoms; ++l) {
+      if (!AtomBounds(pdbs[p].get(), l, lo, hi)) continue;
+      for (int i = lo[0]/brick; i <= hi[0]/brick; ++i) {
+        for (int j = lo[1]/brick; j <= hi[1]/brick; ++j) {
+          for (int k = lo[2]/brick; k <= hi[2]/brick; ++k) {
+            size_t b = ((size_t) i*nbricks[1] + j)*nbricks[2] + k;
+            if (!done[b]) routes[b].push_back(pair<uint32_t, uint32_t>(p, l));
+          }
+        }
+      }
+    }
+  }
+  PNG<PNG_FORMAT_GA>::Pixel *out = (PNG<PNG_FORMAT_GA>::Pixel *) volume->GetBuffer();
+  auto bounds = [&] (size_t b, int *blo, int *bhi) {
+    blo[0] = (b/((size_t) nbricks[1]*nbricks[2]))*brick;
+    blo[1] = (b/nbricks[2] % nbricks[1])*brick;
+    blo[2] = (b % nbricks[2])*brick;
+    bhi[0] = min(blo[0] + brick, x) - 1;
+    bhi[1] = min(blo[1] + brick, y) - 1;
+    bhi[2] = min(blo[2] + brick, z) - 1;
+  };
+  atomic<size_t> next(0);
+  mutex checkpoint, marking;
+  vector<size_t> pending;
+  // Syncs only the voxels of the finished bricks, one span per x plane,
+  // before marking them done; workers keep going meanwhile.
+  auto flush = [&] (const vector<size_t> &batch) {
+    int blo[3], bhi[3];
+    for (auto b : batch) {
+      bounds(b, blo, bhi);
+      for (int i = blo[0]; i <= bhi[0]; ++i) {
+        size_t first = i*a + (size_t) blo[1]*y + blo[2], last = i*a + (size_t) bhi[1]*y + bhi[2] + 1;
+        volume->Sync(first*sizeof(PNG<PNG_FORMAT_GA>::Pixel), (last - first)*sizeof(PNG<PNG_FORMAT_GA>::Pixel));
+      }
+    }
+    lock_guard<mutex> lock(marking);
+    for (auto b : batch) done[b] = 1;
+    progress->Sync();
+  };
+  auto worker = [&] () {
+    int blo[3], bhi[3];
+    vector<size_t> batch;
+    for (size_t b = next++; b < total; b = next++) {
+      if (done[b]) continue;
+      bounds(b, blo, bhi);
+      VoxelizeBrick(out, routes[b], blo, bhi);
+      vector<pair<uint32_t, uint32_t>>().swap(routes[b]);
+      {
+        lock_guard<mutex> lock(checkpoint);
+        pending.push_back(b);
+        if (pending.size() >= BRICK_CHECKPOINT_INTERVAL) batch.swap(pending);
+      }
+      if (!batch.empty()) {
+        flush(batch);
+        batch.clear();
+      }
+    }
+  };
+  vector<thread> pool;
+  for (int t = 0; t < threads; ++t) pool.push_back(thread(worker));
+  for (auto &t : pool) t.join();
+  flush(pending);
+  return volume;
+}
+
+MappedFile::Ptr MappedFile::New(const char *filename, size_t sz) { return MappedFile::Ptr(new MappedFile(filename, sz)); }
+
+MappedFile::MappedFile(const char *filename, size_t sz) : len(sz), created(false) {
+  struct stat st;
+  fd = open(filename, O_RDWR | O_CREAT, 0644);
+  if (fd == -1) Die("Failed to open %s", filename);
+  if (fstat(fd, &st) == -1) Die("Failed to stat %s", filename);
+  if ((size_t) st.st_size != len) {
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, len) == -1) Die("Failed to resize %s", filename);
+    created = true;
+  }
+  data = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) Die("Failed to map %s", filename);
+}
+
+MappedFile::Ptr MappedFile::Open(const char *filename) { return MappedFile::Ptr(new MappedFile(filename)); }
+
+// Maps an existing file copy-on-write: reads come straight from the page
+// cache and writes never reach the file.
+MappedFile::MappedFile(const char *filename) : created(false) {
+  struct stat st;
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) Die("Failed to open %s", filename);
+  if (fstat(fd, &st) == -1) Die("Failed to stat %s", filename);
+  len = st.st_size;
+  data = len ? mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : nullptr;
+  if (data == MAP_FAILED) Die("Failed to map %s", filename);
+}
+
+MappedFile::~MappedFile() {
+  if (data) munmap(data, len);
+  close(fd);
+}
+
+void *MappedFile::GetBuffer() { return data; }
+size_t MappedFile::GetSize() { return len; }
+bool MappedFile::WasCreated() { return created; }
+void MappedFile::Sync() { msync(data, len, MS_SYNC); }
+
+// Syncs the pages covering [offset, offset + length).
+void MappedFile::Sync(size_t offset, size_t length) {
+  size_t page = sysconf(_SC_PAGESIZE), first = offset/page*page;
+  if (length) msync((char *) data + first, offset + length - first, MS_SYNC);
+}
+
 template <typename T> void ParseFilename(char *fn, vector<char *> &filenames, vector<T> &values) {
   char *ptr = fn + strlen(fn);
   filenames.push_back(fn);
   for (; ptr >= fn; ptr--) {
     if (*ptr == ':') {
       *ptr = '\0';
-      values.push_back(atoi(ptr + 1));
+      int value = atoi(ptr + 1);
+      if (value < 0 || value > numeric_limits<T>::max()) Die("Density %d of %s is out of range", value, fn);
+      values.push_back(value);
       return;
     }
   }
   values.push_back(100);
 }
 
+JsonWriter::JsonWriter(int pfd) : fd(pfd), failed(false), keyed(false), sparse(false), precision(JSON_PRECISION_DEFAULT), used(0) {}
+
+JsonWriter::~JsonWriter() { Flush(); }
+
+void JsonWriter::Put(const char *s, size_t n) {
+  if (used + n > sizeof(buffer)) Flush();
+  if (n > sizeof(buffer)) {
+    if (write(fd, s, n) != (ssize_t) n) failed = true;
+    return;
+  }
+  memcpy(buffer + used, s, n);
+  used += n;
+}
+
+void JsonWriter::Put(const char *s) { Put(s, strlen(s)); }
+
+// Emits the separator json-c puts before an array element; an object value
+// directly follows its key.
+void JsonWriter::Value() {
+  if (keyed) keyed = false;
+  else if (!children.empty()) {
+    if (children.back()) Put(",");
+    Put(" ");
+    children.back() = true;
+  }
+}
+
+void JsonWriter::BeginObject() {
+  Value();
+  Put("{");
+  children.push_back(false);
+}
+
+void JsonWriter::EndObject() {
+  children.pop_back();
+  Put(" }");
+}
+
+void JsonWriter::Key(const char *key) {
+  if (children.back()) Put(",");
+  children.back() = true;
+  Put(" \"");
+  for (const char *c = key; *c; ++c) {
+    char escaped[8];
+    if (*c == '"' || *c == '\\' || *c == '/') snprintf(escaped, sizeof(escaped), "\\%c", *c);
+    else if ((unsigned char) *c < 0x20) snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+    else snprintf(escaped, sizeof(escaped), "%c", *c);
+    Put(escaped);
+  }
+  Put("\": ");
+  keyed = true;
+}
+
+void JsonWriter::BeginArray() {
+  Value();
+  Put("[");
+  children.push_back(false);
+}
+
+void JsonWriter::EndArray() {
+  children.pop_back();
+  Put(" ]");
+}
+
+void JsonWriter::Int(long long n) {
+  char buf[32];
+  Value();
+  Put(buf, snprintf(buf, sizeof(buf), "%lld", n));
+}
+
+void JsonWriter::Double(double d) {
+  char buf[64];
+  Value();
+  if (std::isnan(d)) strcpy(buf, "NaN");
+  else if (std::isinf(d)) strcpy(buf, d < 0 ? "-Infinity" : "Infinity");
+  else {
+    if (precision > 0) snprintf(buf, sizeof(buf), "%.*g", precision, d);
+    else if (precision == JSON_PRECISION_SHORTEST) {
+      for (int digits = 15; digits <= 17; ++digits) {
+        snprintf(buf, sizeof(buf), "%.*g", digits, d);
+        if (strtod(buf, nullptr) == d) break;
+      }
+    } else snprintf(buf, sizeof(buf), "%.17g", d);
+    if (!strpbrk(buf, ".eE")) strcat(buf, ".0");
+  }
+  Put(buf);
+}
+
+void JsonWriter::DoubleOrInt(double d) {
+  if (!d) Int(0);
+  else Double(d);
+}
+
+void JsonWriter::Raw(const char *s) { Put(s); }
+
+void JsonWriter::SetSparse(bool s) { sparse = s; }
+bool JsonWriter::IsSparse() { return sparse; }
+void JsonWriter::SetPrecision(int p) { precision = p; }
+
+// Sparse matrices are written as {"i": rows, "j": columns, "v": values}
+// holding only the nonzero cells.
+static void WriteTriplets(JsonWriter &out, const SparseMatrix &m) {
+  out.BeginObject();
+  out.Key("i");
+  out.BeginArray();
+  for (size_t i = 0; i < m.rows; ++i) {
+    for (size_t n = m.offsets[i]; n < m.offsets[i + 1]; ++n) out.Int(i);
+  }
+  out.EndArray();
+  out.Key("j");
+  out.BeginArray();
+  for (auto it = m.columns.begin(); it != m.columns.end(); it++) out.Int(*it);
+  out.EndArray();
+  out.Key("v");
+  out.BeginArray();
+  for (auto it = m.values.begin(); it != m.values.end(); it++) out.DoubleOrInt(*it);
+  out.EndArray();
+  out.EndObject();
+}
+
+static void WriteTriplets(JsonWriter &out, const vector<double> &m, size_t rows, size_t cols) {
+  vector<SparseMatrix::Entry> entries;
+  for (size_t i = 0; i < rows; ++i) {
+    for (size_t j = 0; j < cols; ++j) {
+      if (m[i*cols + j]) entries.push_back(SparseMatrix::Entry(i, j, m[i*cols + j]));
+    }
+  }
+  SparseMatrix sparse;
+  sparse.Assign(rows, cols, entries);
+  WriteTriplets(out, sparse);
+}
+
+int JsonWriter::Flush() {
+  if (used && write(fd, buffer, used) != (ssize_t) used) failed = true;
+  used = 0;
+  return !failed;
+}
+
 json_object *NewDoubleOrInt(double d) {
   if (!d) return json_object_new_int(0);
   return json_object_new_double(d);
@@ -333,22 +968,76 @@ json_object *HMM::as_json_object() {
   json_object_object_add(retval, "states", state_index);
   json_object *initial_states = json_object_new_array();
   json_object_object_add(retval, "initial", initial_states);
-  for (auto it = initial.begin(); it != initial.end(); it++) {
-    json_object_array_add(initial_states, NewDoubleOrInt(*it));
+  for (size_t j = 0, n = initial.offsets[0]; j < states.size(); ++j) {
+    if (n < initial.offsets[1] && initial.columns[n] == j) json_object_array_add(initial_states, NewDoubleOrInt(initial.values[n++]));
+    else json_object_array_add(initial_states, NewDoubleOrInt(0));
   }
   json_object *matrix_array = json_object_new_array();
   json_object_object_add(retval, "matrix", matrix_array); 
   for (size_t i = 0; i < states.size(); ++i) {
     json_object *row = json_object_new_array();
     json_object_array_add(matrix_array, row);
-    for (size_t j = 0; j < states.size(); ++j) {
-      json_object_array_add(row, NewDoubleOrInt(matrix[i*states.size() + j]));
+    for (size_t j = 0, n = matrix.offsets[i]; j < states.size(); ++j) {
+      if (n < matrix.offsets[i + 1] && matrix.columns[n] == j) json_object_array_add(row, NewDoubleOrInt(matrix.values[n++]));
+      else json_object_array_add(row, NewDoubleOrInt(0));
     }
   }
   return retval;
 }
 
+void HMM::Write(JsonWriter &out) {
+  out.BeginObject();
+  out.Key("states");
+  out.BeginArray();
+  for (auto it = states.begin(); it != states.end(); it++) {
+    out.BeginObject();
+    out.Key("density");
+    out.Int(it->first);
+    out.Key("duration");
+    out.Int(it->second);
+    out.EndObject();
+  }
+  out.EndArray();
+  out.Key("initial");
+  if (out.IsSparse()) {
+    WriteTriplets(out, initial);
+    out.Key("matrix");
+    WriteTriplets(out, matrix);
+    out.EndObject();
+    return;
+  }
+  out.BeginArray();
+  for (size_t j = 0, n = initial.offsets[0]; j < states.size(); ++j) {
+    if (n < initial.offsets[1] && initial.columns[n] == j) out.DoubleOrInt(initial.values[n++]);
+    else out.Int(0);
+  }
+  out.EndArray();
+  out.Key("matrix");
+  out.BeginArray();
+  for (size_t i = 0; i < states.size(); ++i) {
+    out.BeginArray();
+    for (size_t j = 0, n = matrix.offsets[i]; j < states.size(); ++j) {
+      if (n < matrix.offsets[i + 1] && matrix.columns[n] == j) out.DoubleOrInt(matrix.values[n++]);
+      else out.Int(0);
+    }
+    out.EndArray();
+  }
+  out.EndArray();
+  out.EndObject();
+}
+
 HMMGroup::Ptr HMMGroup::New() { return HMMGroup::Ptr(new HMMGroup); }
+
+HMMGroup::Ptr HMMGroup::FromCounts(HMMCounts *counts) {
+  HMMGroup::Ptr retval = HMMGroup::New();
+  retval->xpos = counts[0].Build();
+  retval->xneg = counts[1].Build();
+  retval->ypos = counts[2].Build();
+  retval->yneg = counts[3].Build();
+  retval->zpos = counts[4].Build();
+  retval->zneg = counts[5].Build();
+  return retval;
+}
 json_object *HMMGroup::as_json_object() {
   json_object *retval = json_object_new_object();
   json_object_object_add(retval, "xpos", xpos->as_json_object());
@@ -360,12 +1049,183 @@ json_object *HMMGroup::as_json_object() {
   return retval;
 }
 
+void HMMGroup::Write(JsonWriter &out) {
+  out.BeginObject();
+  out.Key("xpos");
+  xpos->Write(out);
+  out.Key("xneg");
+  xneg->Write(out);
+  out.Key("ypos");
+  ypos->Write(out);
+  out.Key("yneg");
+  yneg->Write(out);
+  out.Key("zpos");
+  zpos->Write(out);
+  out.Key("zneg");
+  zneg->Write(out);
+  out.EndObject();
+}
+
 void IncreaseOrDecrease(size_t &n, uint8_t sign) {
   if (sign) n--;
   else n++;
 }
 
-template <typename T> HMM::Ptr CalculateHMM(T *items, size_t *coords, uint8_t fix, uint8_t sign) {
+void HMMCounts::AddState(const HMM::State &s, size_t n) { states[s] += n; }
+void HMMCounts::AddInitial(const HMM::State &s, size_t n) { initial[s] += n; }
+void HMMCounts::AddTransition(const HMM::State &from, const HMM::State &to, size_t n) { transitions[HMM::Transition(from, to)] += n; }
+
+void HMMCounts::Merge(const HMMCounts &other) {
+  for (auto it = other.states.begin(); it != other.states.end(); it++) AddState(it->first, it->second);
+  for (auto it = other.initial.begin(); it != other.initial.end(); it++) AddInitial(it->first, it->second);
+  for (auto it = other.transitions.begin(); it != other.transitions.end(); it++) AddTransition(it->first.first, it->first.second, it->second);
+}
+
+// Accepts "log", "log:<base>", "quantile" or "quantile:<bins>".
+bool Quantization::Parse(const char *spec) {
+  string s(spec);
+  size_t colon = s.find(':');
+  string kind = s.substr(0, colon);
+  const char *arg = colon == string::npos ? nullptr : spec + colon + 1;
+  if (kind == "log") {
+    mode = Log;
+    if (arg) base = atof(arg);
+    return base > 1;
+  }
+  if (kind == "quantile") {
+    mode = Quantile;
+    if (arg) bins = atoi(arg);
+    return bins > 0;
+  }
+  return false;
+}
+
+HMMCounts HMMCounts::Quantize(const Quantization &q) const {
+  map<uint8_t, vector<pair<size_t, size_t> > > runs;
+  for (auto it = states.begin(); it != states.end(); it++) {
+    runs[it->first.first].push_back(make_pair(it->first.second, it->second));
+  }
+  unordered_map<HMM::State, HMM::State, StateHash> remap;
+  for (auto it = runs.begin(); it != runs.end(); it++) {
+    vector<pair<size_t, size_t> > &lengths = it->second;
+    sort(lengths.begin(), lengths.end());
+    size_t total = 0, seen = 0;
+    for (auto l = lengths.begin(); l != lengths.end(); l++) total += l->second;
+    vector<pair<size_t, size_t> > binned;
+    for (auto l = lengths.begin(); l != lengths.end(); l++) {
+      size_t bin = l->first;
+      if (q.mode == Quantization::Log) {
+        bin = (size_t) floor(log((double) l->first)/log(q.base) + 1e-9);
+      } else if (q.mode == Quantization::Quantile) {
+        bin = seen*q.bins/total;
+      }
+      seen += l->second;
+      if (binned.empty() || binned.back().first != bin) binned.push_back(make_pair(bin, 0));
+      binned.back().second += l->second;
+      remap[HMM::State(it->first, l->first)] = HMM::State(it->first, bin);
+    }
+    // Representatives are the shortest duration falling into each bin.
+    map<size_t, size_t> shortest, count;
+    for (auto l = lengths.rbegin(); l != lengths.rend(); l++) {
+      HMM::State &r = remap[HMM::State(it->first, l->first)];
+      shortest[r.second] = l->first;
+    }
+    for (auto b = binned.begin(); b != binned.end(); b++) count[shortest[b->first]] = b->second;
+    for (auto l = lengths.begin(); l != lengths.end(); l++) {
+      HMM::State &r = remap[HMM::State(it->first, l->first)];
+      r.second = shortest[r.second];
+    }
+    if (!q.min_count) continue;
+    vector<size_t> kept;
+    for (auto c = count.begin(); c != count.end(); c++) {
+      if (c->second >= q.min_count) kept.push_back(c->first);
+    }
+    if (kept.empty()) continue;
+    for (auto l = lengths.begin(); l != lengths.end(); l++) {
+      HMM::State &r = remap[HMM::State(it->first, l->first)];
+      if (count[r.second] >= q.min_count) continue;
+      auto above = lower_bound(kept.begin(), kept.end(), r.second);
+      if (above == kept.end() || (above != kept.begin() && r.second - *(above - 1) <= *above - r.second)) above--;
+      r.second = *above;
+    }
+  }
+  HMMCounts retval;
+  for (auto it = states.begin(); it != states.end(); it++) retval.AddState(remap[it->first], it->second);
+  for (auto it = initial.begin(); it != initial.end(); it++) retval.AddInitial(remap[it->first], it->second);
+  for (auto it = transitions.begin(); it != transitions.end(); it++) {
+    retval.AddTransition(remap[it->first.first], remap[it->first.second], it->second);
+  }
+  return retval;
+}
+
+// Normalizes the counts into an HMM whose states are every distinct run
+// sorted ascending, exactly as the run lists CalculateHMM used to collect
+// and sort would have produced. Only observed transitions are stored.
+HMM::Ptr HMMCounts::Build() {
+  HMM::Ptr retval = HMM::New();
+  for (auto it = states.begin(); it != states.end(); it++) {
+    retval->states.push_back(it->first);
+  }
+  sort(retval->states.begin(), retval->states.end());
+  size_t n = retval->states.size();
+  unordered_map<HMM::State, size_t, StateHash> state_map;
+  for (size_t i = 0; i < n; ++i) {
+    state_map[retval->states[i]] = i;
+  }
+  vector<SparseMatrix::Entry> entries;
+  for (auto it = transitions.begin(); it != transitions.end(); it++) {
+    entries.push_back(SparseMatrix::Entry(state_map[it->first.first], state_map[it->first.second], it->second));
+  }
+  retval->matrix.Assign(n, n, entries);
+  retval->matrix.Normalize();
+  entries.clear();
+  for (auto it = initial.begin(); it != initial.end(); it++) {
+    entries.push_back(SparseMatrix::Entry(0, state_map[it->first], it->second));
+  }
+  retval->initial.Assign(1, n, entries);
+  retval->initial.Normalize();
+  return retval;
+}
+
+SparseMatrix::SparseMatrix() : rows(0), cols(0), offsets(1, 0) {}
+
+// Builds the rows from unordered (row, column, value) triples; entries
+// sharing a cell are summed.
+void SparseMatrix::Assign(size_t r, size_t c, vector<Entry> &entries) {
+  rows = r;
+  cols = c;
+  sort(entries.begin(), entries.end());
+  offsets.assign(rows + 1, 0);
+  columns.clear();
+  values.clear();
+  for (auto it = entries.begin(); it != entries.end(); it++) {
+    if (!columns.empty() && offsets[get<0>(*it) + 1] && columns.back() == get<1>(*it)) {
+      values.back() += get<2>(*it);
+      continue;
+    }
+    offsets[get<0>(*it) + 1]++;
+    columns.push_back(get<1>(*it));
+    values.push_back(get<2>(*it));
+  }
+  for (size_t i = 0; i < rows; ++i) offsets[i + 1] += offsets[i];
+}
+
+double SparseMatrix::Get(size_t i, size_t j) const {
+  auto first = columns.begin() + offsets[i], last = columns.begin() + offsets[i + 1];
+  auto it = lower_bound(first, last, (uint32_t) j);
+  if (it == last || *it != j) return 0;
+  return values[distance(columns.begin(), it)];
+}
+
+void SparseMatrix::Normalize() {
+  for (size_t i = 0; i < rows; ++i) {
+    double sum = 0;
+    for (size_t n = offsets[i]; n < offsets[i + 1]; ++n) sum += values[n];
+    if (sum) for (size_t n = offsets[i]; n < offsets[i + 1]; ++n) values[n] /= sum;
+  }
+}
+
+template <typename T> void CountHMM(T *items, size_t *coords, uint8_t fix, uint8_t sign, HMMCounts &counts) {
   size_t permutecoords[3];
   size_t multiplier[3];
   size_t idx = 0;
@@ -388,24 +1248,21 @@ template <typename T> HMM::Ptr CalculateHMM(T *items, size_t *coords, uint8_t fi
       multiplier[idx] = 1;
   }
   permutecoords[idx] = coords[fix];
-  HMM::Ptr retval = HMM::New();
   uint8_t last_depth = 0;
   uint8_t depth = 0;
   size_t duration = 0;
   bool starting = true;
   bool initial = true;
   HMM::State last_state;
-  vector<HMM::State> initial_states;
-  vector<HMM::Transition> transitions;
   for (size_t i = 0; i < permutecoords[0]; ++i) {
     for (size_t j = 0; j < permutecoords[1]; ++j) {
       for (size_t k = (sign == 1 ? permutecoords[2] - 1: 0); (sign == 1 ? k != ((size_t) 0 - (size_t) 1) : k < permutecoords[2]); IncreaseOrDecrease(k, sign)) {
         depth = items[i*multiplier[0] + j*multiplier[1] + multiplier[2]*k].GetValue();
         if (!starting && (last_depth != depth)) {
           if (initial)
-            initial_states.push_back(HMM::State(last_depth, duration));
-          else transitions.push_back(HMM::Transition(last_state, HMM::State(last_depth, duration)));
-          retval->states.push_back(HMM::State(last_depth, duration));
+            counts.AddInitial(HMM::State(last_depth, duration));
+          else counts.AddTransition(last_state, HMM::State(last_depth, duration));
+          counts.AddState(HMM::State(last_depth, duration));
           last_state = HMM::State(last_depth, duration);
           duration = 0;
           initial = false;
@@ -415,10 +1272,10 @@ template <typename T> HMM::Ptr CalculateHMM(T *items, size_t *coords, uint8_t fi
         starting = false;
       }
       if (initial) {
-        initial_states.push_back(HMM::State(depth, duration));
+        counts.AddInitial(HMM::State(depth, duration));
       }
-      else transitions.push_back(HMM::Transition(last_state, HMM::State(depth, duration)));
-      retval->states.push_back(HMM::State(depth, duration));
+      else counts.AddTransition(last_state, HMM::State(depth, duration));
+      counts.AddState(HMM::State(depth, duration));
       memset(&last_state, 0, sizeof(HMM::State)); 
       duration = 0;
       last_depth = 0;
@@ -427,40 +1284,18 @@ template <typename T> HMM::Ptr CalculateHMM(T *items, size_t *coords, uint8_t fi
       starting = true;
     }
   }
-  sort(retval->states.begin(), retval->states.end());
-  auto it = unique(retval->states.begin(), retval->states.end(), [&] (HMM::State a, HMM::State b) -> bool {
-    return ((a.first == b.first) && (b.second == a.second));
-  });
-  retval->states.resize(distance(retval->states.begin(), it));
-  retval->matrix.resize(retval->states.size() * retval->states.size());
-  map<HMM::State, size_t> state_map;
-  for (auto it = retval->states.begin(); it != retval->states.end(); it++) {
-    state_map[*it] = distance(retval->states.begin(), it);
-  }
-  for (auto it = transitions.begin(); it != transitions.end(); it++) {
-    retval->matrix[state_map[it->first]*retval->states.size() + state_map[it->second]]++;
-  }
-  for (size_t i = 0; i < retval->states.size(); ++i) {
-    double sum = 0;
-    for (size_t j = 0; j < retval->states.size(); ++j) {
-      sum += retval->matrix[i*retval->states.size() + j];
-    }
-    if (sum) for (size_t j = 0; j < retval->states.size(); ++j) {
-      retval->matrix[i*retval->states.size() + j] /= sum;
-    }
-  }
-  retval->initial.resize(retval->states.size());
-  for (auto it = initial_states.begin(); it != initial_states.end(); it++) {
-    retval->initial[state_map[*it]]++;
-  }
-  double sum = 0;
-  for (size_t i = 0; i < retval->states.size(); ++i) {
-    sum += retval->initial[i];
-  }
-  if (sum) for (size_t i = 0; i < retval->states.size(); ++i) {
-    retval->initial[i] /= sum;
-  }
-  return retval;
+}
+
+template <typename T> HMM::Ptr CalculateHMM(T *items, size_t *coords, uint8_t fix, uint8_t sign) {
+  HMMCounts counts;
+  CountHMM(items, coords, fix, sign, counts);
+  return counts.Build();
+}
+
+template <typename T> HSMM::Ptr CalculateHSMM(T *items, size_t *coords, uint8_t fix, uint8_t sign) {
+  HMMCounts counts;
+  CountHMM(items, coords, fix, sign, counts);
+  return HSMM::FromCounts(counts);
 }
 
 json_object *HMM2DToJsonObject(HMM2D::Ptr a) {
@@ -487,156 +1322,1207 @@ json_object *HMM2DToJsonObject(HMM2D::Ptr a) {
   for (size_t i = 0; i < a->xobs.size(); ++i) {
     json_object_array_add(obs, json_object_new_int(a->xobs[i]));
   }
-  json_object_object_add(obj, "observed", obs);
-  json_object_object_add(obj, "transition", transitions);
-  json_object_object_add(obj, "initial", initial);
-  json_object_object_add(retval, "x", obj);
-  obj = json_object_new_object();
-  transitions = json_object_new_array();
-  initial = json_object_new_array();
-  for (size_t i = 0; i < a->states.size(); ++i) {
-    json_object *row = json_object_new_array();
-    json_object_array_add(transitions, row);
-    for (size_t j = 0; j < a->states.size(); ++j) {
-      json_object_array_add(row, json_object_new_double(a->ytransition[i*a->states.size() + j]));
+  json_object_object_add(obj, "observed", obs);
+  json_object_object_add(obj, "transition", transitions);
+  json_object_object_add(obj, "initial", initial);
+  json_object_object_add(retval, "x", obj);
+  obj = json_object_new_object();
+  transitions = json_object_new_array();
+  initial = json_object_new_array();
+  for (size_t i = 0; i < a->states.size(); ++i) {
+    json_object *row = json_object_new_array();
+    json_object_array_add(transitions, row);
+    for (size_t j = 0; j < a->states.size(); ++j) {
+      json_object_array_add(row, json_object_new_double(a->ytransition[i*a->states.size() + j]));
+    }
+  }
+  for (size_t i = 0; i < a->yinitial.size(); ++i) {
+    json_object_array_add(initial, json_object_new_double(a->yinitial[i]));
+  }
+  obs = json_object_new_array();
+  for (size_t i = 0; i < a->yobs.size(); ++i) {
+    json_object_array_add(obs, json_object_new_int(a->yobs[i]));
+  }
+  json_object_object_add(obj, "observed", obs);
+  json_object_object_add(obj, "transition", transitions);
+  json_object_object_add(obj, "initial", initial);
+  json_object_object_add(retval, "y", obj);
+  return retval;
+}
+
+template <typename C> typename Counts2D<C>::Ptr Counts2D<C>::New() { return Ptr(new Counts2D()); }
+
+// Counts both scan directions in one row-major pass: the x lines are rows
+// and the y lines columns, so each pixel's y predecessor is the same column
+// one row back (or ahead, when reversed).
+template <typename T> void Count2DHMM(T *items, size_t *coords, bool reverse, HMM2DCounts *counts) {
+  size_t first = reverse ? coords[1] - 1 : 0;
+  size_t first_row = reverse ? coords[0] - 1 : 0;
+  for (size_t i = 0; i < coords[0]; ++i) {
+    T *row = items + i*coords[0];
+    for (size_t j = 0; j < coords[1]; ++j) {
+      uint8_t depth = row[j].GetValue();
+      counts->seen[depth]++;
+      if (j == first) counts->xinitial[depth]++;
+      else counts->xtransition[row[reverse ? j + 1 : j - 1].GetValue()][depth]++;
+      if (i == first_row) counts->yinitial[depth]++;
+      else counts->ytransition[items[(reverse ? i + 1 : i - 1)*coords[0] + j].GetValue()][depth]++;
+    }
+  }
+}
+
+// Compacts the tables to the observed states in ascending order. whole keeps
+// the raw transition counts and their row and column sums as well.
+template <typename C> HMM2D::Ptr Counts2D<C>::Build(bool whole) {
+  HMM2D::Ptr retval = HMM2D::New();
+  for (size_t v = 0; v < 256; ++v) {
+    if (!seen[v]) continue;
+    retval->state_map[v] = retval->states.size();
+    retval->states.push_back(v);
+  }
+  size_t n = retval->states.size();
+  retval->xtransition.assign(n*n, 0);
+  retval->ytransition.assign(n*n, 0);
+  retval->xinitial.assign(n, 0);
+  retval->yinitial.assign(n, 0);
+  for (size_t i = 0; i < n; ++i) {
+    retval->xinitial[i] = xinitial[retval->states[i]];
+    retval->yinitial[i] = yinitial[retval->states[i]];
+    for (size_t j = 0; j < n; ++j) {
+      retval->xtransition[i*n + j] = xtransition[retval->states[i]][retval->states[j]];
+      retval->ytransition[i*n + j] = ytransition[retval->states[i]][retval->states[j]];
+    }
+  }
+  if (whole) {
+    retval->xtransitionwhole.assign(retval->xtransition.begin(), retval->xtransition.end());
+    retval->ytransitionwhole.assign(retval->ytransition.begin(), retval->ytransition.end());
+    for (size_t j = 0; j < n; ++j) {
+      size_t xsum = 0, ysum = 0;
+      for (size_t i = 0; i < n; ++i) {
+        xsum += retval->xtransitionwhole[i*n + j];
+        ysum += retval->ytransitionwhole[i*n + j];
+      }
+      retval->xcolsums.push_back(xsum);
+      retval->ycolsums.push_back(ysum);
+    }
+  }
+  vector<double> *matrices[] = { &retval->xtransition, &retval->ytransition };
+  vector<size_t> *rowsums[] = { &retval->xrowsums, &retval->yrowsums };
+  for (int m = 0; m < 2; ++m) {
+    vector<double> &matrix = *matrices[m];
+    for (size_t i = 0; i < n; ++i) {
+      double sum = 0;
+      for (size_t j = 0; j < n; ++j) sum += matrix[i*n + j];
+      if (whole) rowsums[m]->push_back(sum);
+      if (sum) for (size_t j = 0; j < n; ++j) matrix[i*n + j] /= sum;
+    }
+  }
+  vector<double> *initials[] = { &retval->xinitial, &retval->yinitial };
+  for (int m = 0; m < 2; ++m) {
+    vector<double> &initial = *initials[m];
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i) sum += initial[i];
+    if (sum) for (size_t i = 0; i < n; ++i) initial[i] /= sum;
+  }
+  return retval;
+}
+
+void WriteHMM2D(JsonWriter &out, HMM2D::Ptr a) {
+  size_t n = a->states.size();
+  out.BeginObject();
+  out.Key("states");
+  out.BeginArray();
+  for (auto it = a->states.begin(); it != a->states.end(); it++) out.Int(*it);
+  out.EndArray();
+  HMM2D::Direction axes[] = { HMM2D::Direction::X, HMM2D::Direction::Y };
+  const char *names[] = { "x", "y" };
+  for (size_t d = 0; d < 2; ++d) {
+    vector<double> &matrix = a->GetTransition(axes[d]);
+    vector<double> &start = a->GetInitial(axes[d]);
+    vector<HMM2D::Observation> &observed = a->GetObservations(axes[d]);
+    out.Key(names[d]);
+    out.BeginObject();
+    out.Key("observed");
+    out.BeginArray();
+    for (auto it = observed.begin(); it != observed.end(); it++) out.Int((int) *it);
+    out.EndArray();
+    out.Key("transition");
+    out.BeginArray();
+    for (size_t i = 0; i < n; ++i) {
+      out.BeginArray();
+      for (size_t j = 0; j < n; ++j) out.Double(matrix[i*n + j]);
+      out.EndArray();
+    }
+    out.EndArray();
+    out.Key("initial");
+    out.BeginArray();
+    for (auto it = start.begin(); it != start.end(); it++) out.Double(*it);
+    out.EndArray();
+    out.EndObject();
+  }
+  out.EndObject();
+}
+
+void WriteHMM3D(JsonWriter &out, HMM3D::Ptr a) {
+  size_t n = a->states.size();
+  out.BeginObject();
+  out.Key("states");
+  out.BeginArray();
+  for (auto it = a->states.begin(); it != a->states.end(); it++) out.Int(*it);
+  out.EndArray();
+  HMM3D::Direction axes[] = { HMM3D::Direction::X, HMM3D::Direction::Y, HMM3D::Direction::Z };
+  const char *names[] = { "x", "y", "z" };
+  for (size_t d = 0; d < 3; ++d) {
+    vector<double> &matrix = a->GetTransition(axes[d]);
+    vector<double> &start = a->GetInitial(axes[d]);
+    vector<HMM3D::Observation> &observed = a->GetObservations(axes[d]);
+    out.Key(names[d]);
+    out.BeginObject();
+    out.Key("observed");
+    out.BeginArray();
+    for (auto it = observed.begin(); it != observed.end(); it++) out.Int((long long) *it);
+    out.EndArray();
+    out.Key("transition");
+    out.BeginArray();
+    for (size_t i = 0; i < n; ++i) {
+      out.BeginArray();
+      for (size_t j = 0; j < n; ++j) out.Double(matrix[i*n + j]);
+      out.EndArray();
+    }
+    out.EndArray();
+    out.Key("initial");
+    out.BeginArray();
+    for (auto it = start.begin(); it != start.end(); it++) out.Double(*it);
+    out.EndArray();
+    out.EndObject();
+  }
+  out.EndObject();
+}
+
+template <typename T> HMM2D::Ptr Calculate2DHMM(T *items, size_t *coords) {
+  HMM2DCounts::Ptr counts = HMM2DCounts::New();
+  Count2DHMM(items, coords, false, counts.get());
+  return counts->Build(true);
+}
+
+// Collects the runs of one scanline in the shape CalculateHMM counts them:
+// the first run is the initial state and each later run is a transition from
+// the one before it. Reading the same line backwards makes the last run
+// initial and flips every transition, so one pass over the runs feeds both
+// the positive (pos) and negative (neg) direction; either may be null. Both
+// directions see the same run states, so those are only counted into pos
+// when it is present and copied over once the sweep is done.
+struct LineRuns {
+  HMM::State first;
+  HMM::State last;
+  bool started;
+};
+
+static inline void PushRun(HMMCounts *pos, HMMCounts *neg, LineRuns &line, const HMM::State &state) {
+  if (!line.started) {
+    line.first = state;
+    line.started = true;
+  } else {
+    if (pos) pos->AddTransition(line.last, state);
+    if (neg) neg->AddTransition(state, line.last);
+  }
+  line.last = state;
+  (pos ? pos : neg)->AddState(state);
+}
+
+static inline void EndLine(HMMCounts *pos, HMMCounts *neg, LineRuns &line) {
+  if (pos) pos->AddInitial(line.first);
+  if (neg) neg->AddInitial(line.last);
+  line.started = false;
+}
+
+// Builds all six directional models in one sweep over the volume in memory
+// order. Every voxel extends the run of its z line, of its y line (one lane
+// per k for the current i) and of its x line (one lane per (j, k)), so no
+// axis is read with a stride, and each run list yields both signs.
+template <typename T> void CountHMMGroup(T *items, size_t *dimensions, HMMCounts *counts) {
+  size_t x = dimensions[0], y = dimensions[1], z = dimensions[2];
+  HMMCounts &xpos = counts[0], &xneg = counts[1], &ypos = counts[2], &yneg = counts[3], &zpos = counts[4], &zneg = counts[5];
+  LineRuns blank = { HMM::State(), HMM::State(), false };
+  LineRuns zline = blank;
+  vector<LineRuns> ylines(z, blank), xlines(y*z, blank);
+  vector<uint8_t> ydepth(z), xdepth(y*z);
+  vector<size_t> ystart(z), xstart(y*z);
+  uint8_t zdepth = 0;
+  size_t zstart = 0;
+  for (size_t i = 0; i < x; ++i) {
+    for (size_t j = 0; j < y; ++j) {
+      for (size_t k = 0; k < z; ++k) {
+        uint8_t depth = items[i*x*y + j*y + k].GetValue();
+        size_t lane = j*z + k;
+        if (!k) zstart = 0;
+        else if (depth != zdepth) {
+          PushRun(&zpos, &zneg, zline, HMM::State(zdepth, k - zstart));
+          zstart = k;
+        }
+        zdepth = depth;
+        if (!j) ystart[k] = 0;
+        else if (depth != ydepth[k]) {
+          PushRun(&ypos, &yneg, ylines[k], HMM::State(ydepth[k], j - ystart[k]));
+          ystart[k] = j;
+        }
+        ydepth[k] = depth;
+        if (!i) xstart[lane] = 0;
+        else if (depth != xdepth[lane]) {
+          PushRun(&xpos, &xneg, xlines[lane], HMM::State(xdepth[lane], i - xstart[lane]));
+          xstart[lane] = i;
+        }
+        xdepth[lane] = depth;
+      }
+      if (z) {
+        PushRun(&zpos, &zneg, zline, HMM::State(zdepth, z - zstart));
+        EndLine(&zpos, &zneg, zline);
+      }
+    }
+    if (y) for (size_t k = 0; k < z; ++k) {
+      PushRun(&ypos, &yneg, ylines[k], HMM::State(ydepth[k], y - ystart[k]));
+      EndLine(&ypos, &yneg, ylines[k]);
+    }
+  }
+  if (x) for (size_t lane = 0; lane < y*z; ++lane) {
+    PushRun(&xpos, &xneg, xlines[lane], HMM::State(xdepth[lane], x - xstart[lane]));
+    EndLine(&xpos, &xneg, xlines[lane]);
+  }
+  xneg.states = xpos.states;
+  yneg.states = ypos.states;
+  zneg.states = zpos.states;
+}
+
+template <typename T> HMMGroup::Ptr CalculateHMMGroup(T *items, size_t *dimensions) {
+  HMMCounts counts[6];
+  CountHMMGroup(items, dimensions, counts);
+  return HMMGroup::FromCounts(counts);
+}
+
+BitVolume::Ptr BitVolume::New(size_t i, size_t j, size_t k, uint8_t val) { return BitVolume::Ptr(new BitVolume(i, j, k, val)); }
+
+BitVolume::BitVolume(size_t i, size_t j, size_t k, uint8_t val) : x(i), y(j), z(k), words((k + 63)/64), value(val), bits(i*j*((k + 63)/64), 0) {}
+
+uint64_t BitVolume::Mask(size_t w) {
+  if (w + 1 < words || !(z % 64)) return ~(uint64_t) 0;
+  return ((uint64_t) 1 << (z % 64)) - 1;
+}
+
+BitVolume::Ptr MultiPDBVoxelizer::VoxelizeOccupancy() {
+  BitVolume::Ptr retval = BitVolume::New(x, y, z, 0xff);
+  int lo[3], hi[3];
+  for (auto it = pdbs.begin(); it != pdbs.end(); it++) {
+    for (int l = 0; l < (*it)->natoms; ++l) {
+      if (!AtomBounds(it->get(), l, lo, hi)) continue;
+      for (int i = lo[0]; i <= hi[0]; ++i) {
+        for (int j = lo[1]; j <= hi[1]; ++j) {
+          for (int k = lo[2]; k <= hi[2]; ++k) {
+            if (!retval->Get(i, j, k) && Covers(it->get(), l, i, j, k)) retval->Set(i, j, k);
+          }
+        }
+      }
+    }
+  }
+  return retval;
+}
+
+PNG<PNG_FORMAT_GA>::Pixel *ZSlice(BitVolume::Ptr values, size_t z) {
+  PNG<PNG_FORMAT_GA>::Pixel *retval = new PNG<PNG_FORMAT_GA>::Pixel[values->x*values->y];
+  uint64_t bit = (uint64_t) 1 << (z % 64);
+  for (size_t i = 0; i < values->x; ++i) {
+    for (size_t j = 0; j < values->y; ++j) {
+      if (values->Line(i, j)[z/64] & bit) retval[i*values->x + j] = { values->value, 0xff };
+      else retval[i*values->x + j] = { 0, 0 };
+    }
+  }
+  return retval;
+}
+
+// Run-length extraction straight from the packed words. Along z each line is
+// contiguous, so run boundaries are the set bits of w ^ (w << 1) and are
+// visited with ctz. Along x and y the 64 lines sharing a word are walked in
+// lockstep and boundaries are the set bits of the xor of adjacent words.
+void CountRuns(BitVolume::Ptr items, uint8_t fix, HMMCounts *pos, HMMCounts *neg) {
+  uint8_t value = items->value;
+  if (fix == 2) {
+    LineRuns line = { HMM::State(), HMM::State(), false };
+    for (size_t i = 0; i < items->x; ++i) {
+      for (size_t j = 0; j < items->y; ++j) {
+        uint64_t *words = items->Line(i, j);
+        size_t start = 0;
+        uint64_t carry = words[0] & 1;
+        for (size_t w = 0; w < items->words; ++w) {
+          uint64_t edges = (words[w] ^ ((words[w] << 1) | carry)) & items->Mask(w);
+          if (!w) edges &= ~(uint64_t) 1;
+          carry = words[w] >> 63;
+          for (; edges; edges &= edges - 1) {
+            size_t k = w*64 + __builtin_ctzll(edges);
+            PushRun(pos, neg, line, HMM::State(items->Get(i, j, start) ? value : 0, k - start));
+            start = k;
+          }
+        }
+        PushRun(pos, neg, line, HMM::State(items->Get(i, j, start) ? value : 0, items->z - start));
+        EndLine(pos, neg, line);
+      }
+    }
+  } else {
+    size_t outer = (fix == 0 ? items->y : items->x);
+    size_t length = (fix == 0 ? items->x : items->y);
+    vector<LineRuns> lines(items->words*64, { HMM::State(), HMM::State(), false });
+    vector<size_t> start(items->words*64);
+    auto word = [&] (size_t o, size_t n, size_t w) -> uint64_t {
+      return (fix == 0 ? items->Line(n, o) : items->Line(o, n))[w];
+    };
+    for (size_t o = 0; o < outer; ++o) {
+      fill(start.begin(), start.end(), 0);
+      for (size_t w = 0; w < items->words; ++w) {
+        for (size_t n = 1; n < length; ++n) {
+          uint64_t previous = word(o, n - 1, w);
+          for (uint64_t edges = (previous ^ word(o, n, w)) & items->Mask(w); edges; edges &= edges - 1) {
+            size_t b = w*64 + __builtin_ctzll(edges);
+            PushRun(pos, neg, lines[b], HMM::State((previous >> (b % 64)) & 1 ? value : 0, n - start[b]));
+            start[b] = n;
+          }
+        }
+        uint64_t previous = word(o, length - 1, w);
+        for (size_t b = w*64; b < min(w*64 + 64, items->z); ++b) {
+          PushRun(pos, neg, lines[b], HMM::State((previous >> (b % 64)) & 1 ? value : 0, length - start[b]));
+          EndLine(pos, neg, lines[b]);
+        }
+      }
+    }
+  }
+}
+
+HMM::Ptr CalculateHMM(BitVolume::Ptr items, uint8_t fix, uint8_t sign) {
+  HMMCounts counts;
+  if (sign) CountRuns(items, fix, nullptr, &counts);
+  else CountRuns(items, fix, &counts, nullptr);
+  return counts.Build();
+}
+
+void CountHMMGroup(BitVolume::Ptr items, HMMCounts *counts) {
+  for (uint8_t fix = 0; fix < 3; ++fix) {
+    CountRuns(items, fix, &counts[fix*2], &counts[fix*2 + 1]);
+    counts[fix*2 + 1].states = counts[fix*2].states;
+  }
+}
+
+HMMGroup::Ptr CalculateHMMGroup(BitVolume::Ptr items) {
+  HMMCounts counts[6];
+  CountHMMGroup(items, counts);
+  return HMMGroup::FromCounts(counts);
+}
+
+// Runs of the y and z lines of the slabs i0 <= i < i1. Lines never cross
+// slabs, so disjoint slabs can be counted on different threads.
+template <typename T> void CountPlaneRuns(T *items, size_t *dimensions, size_t i0, size_t i1, HMMCounts *counts) {
+  size_t x = dimensions[0], y = dimensions[1], z = dimensions[2];
+  LineRuns blank = { HMM::State(), HMM::State(), false };
+  LineRuns zline = blank;
+  vector<LineRuns> ylines(z, blank);
+  vector<uint8_t> ydepth(z);
+  vector<size_t> ystart(z);
+  uint8_t zdepth = 0;
+  size_t zstart = 0;
+  for (size_t i = i0; i < i1; ++i) {
+    for (size_t j = 0; j < y; ++j) {
+      for (size_t k = 0; k < z; ++k) {
+        uint8_t depth = items[i*x*y + j*y + k].GetValue();
+        if (!k) zstart = 0;
+        else if (depth != zdepth) {
+          PushRun(&counts[4], &counts[5], zline, HMM::State(zdepth, k - zstart));
+          zstart = k;
+        }
+        zdepth = depth;
+        if (!j) ystart[k] = 0;
+        else if (depth != ydepth[k]) {
+          PushRun(&counts[2], &counts[3], ylines[k], HMM::State(ydepth[k], j - ystart[k]));
+          ystart[k] = j;
+        }
+        ydepth[k] = depth;
+      }
+      if (z) {
+        PushRun(&counts[4], &counts[5], zline, HMM::State(zdepth, z - zstart));
+        EndLine(&counts[4], &counts[5], zline);
+      }
+    }
+    if (y) for (size_t k = 0; k < z; ++k) {
+      PushRun(&counts[2], &counts[3], ylines[k], HMM::State(ydepth[k], y - ystart[k]));
+      EndLine(&counts[2], &counts[3], ylines[k]);
+    }
+  }
+}
+
+// Runs of the x lines whose j is in [j0, j1). Each i visits one contiguous
+// block of those rows, so the walk stays in memory order.
+template <typename T> void CountColumnRuns(T *items, size_t *dimensions, size_t j0, size_t j1, HMMCounts *counts) {
+  size_t x = dimensions[0], y = dimensions[1], z = dimensions[2];
+  LineRuns blank = { HMM::State(), HMM::State(), false };
+  size_t lanes = (j1 - j0)*z;
+  vector<LineRuns> xlines(lanes, blank);
+  vector<uint8_t> xdepth(lanes);
+  vector<size_t> xstart(lanes, 0);
+  for (size_t i = 0; i < x; ++i) {
+    for (size_t j = j0; j < j1; ++j) {
+      for (size_t k = 0; k < z; ++k) {
+        uint8_t depth = items[i*x*y + j*y + k].GetValue();
+        size_t lane = (j - j0)*z + k;
+        if (i && depth != xdepth[lane]) {
+          PushRun(&counts[0], &counts[1], xlines[lane], HMM::State(xdepth[lane], i - xstart[lane]));
+          xstart[lane] = i;
+        }
+        xdepth[lane] = depth;
+      }
+    }
+  }
+  if (x) for (size_t lane = 0; lane < lanes; ++lane) {
+    PushRun(&counts[0], &counts[1], xlines[lane], HMM::State(xdepth[lane], x - xstart[lane]));
+    EndLine(&counts[0], &counts[1], xlines[lane]);
+  }
+}
+
+// Parallel CountHMMGroup. Threads first split the x slabs to count the y
+// and z lines, then split the rows to count the x lines, each into its own
+// tables. The tables are merged in thread order; merged counts and therefore
+// the models do not depend on the thread count.
+template <typename T> void CountHMMGroup(T *items, size_t *dimensions, int threads, HMMCounts *counts) {
+  if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+  if (threads == 1) return CountHMMGroup(items, dimensions, counts);
+  vector<vector<HMMCounts>> tables(threads, vector<HMMCounts>(6));
+  vector<thread> pool;
+  for (int t = 0; t < threads; ++t) {
+    pool.push_back(thread([&, t] () {
+      CountPlaneRuns(items, dimensions, dimensions[0]*t/threads, dimensions[0]*(t + 1)/threads, &tables[t][0]);
+      CountColumnRuns(items, dimensions, dimensions[1]*t/threads, dimensions[1]*(t + 1)/threads, &tables[t][0]);
+    }));
+  }
+  for (auto &t : pool) t.join();
+  for (size_t m = 0; m < 6; ++m) {
+    counts[m] = move(tables[0][m]);
+    for (int t = 1; t < threads; ++t) counts[m].Merge(tables[t][m]);
+  }
+  for (size_t m = 0; m < 6; m += 2) counts[m + 1].states = counts[m].states;
+}
+
+// Adds (sign 1) or removes (sign -1) the contribution of one line's runs,
+// dropping entries whose count reaches zero so Build only sees live states.
+template <typename K, typename H> static void Adjust(unordered_map<K, size_t, H> &table, const K &key, int sign) {
+  if (sign > 0) table[key]++;
+  else if (!--table[key]) table.erase(key);
+}
+
+void IncrementalHMMGroup::Apply(int axis, const vector<HMM::State> &runs, int sign) {
+  HMMCounts &pos = counts[axis*2], &neg = counts[axis*2 + 1];
+  if (runs.empty()) return;
+  Adjust(pos.initial, runs.front(), sign);
+  Adjust(neg.initial, runs.back(), sign);
+  for (size_t r = 0; r < runs.size(); ++r) {
+    Adjust(pos.states, runs[r], sign);
+    Adjust(neg.states, runs[r], sign);
+    if (!r) continue;
+    Adjust(pos.transitions, HMM::Transition(runs[r - 1], runs[r]), sign);
+    Adjust(neg.transitions, HMM::Transition(runs[r], runs[r - 1]), sign);
+  }
+}
+
+// Line numbering per axis: x lines are j*z + k, y lines i*z + k and z lines
+// i*y + j, walking the same voxel offsets as CountHMMGroup.
+template <typename T> void IncrementalHMMGroup::Scan(T *items, int axis, size_t line) {
+  size_t x = dimensions[0], y = dimensions[1], z = dimensions[2];
+  size_t start, stride, length = dimensions[axis];
+  if (axis == 0) start = (line/z)*y + line%z, stride = x*y;
+  else if (axis == 1) start = (line/z)*x*y + line%z, stride = y;
+  else start = (line/y)*x*y + (line%y)*y, stride = 1;
+  vector<HMM::State> &runs = lines[axis][line];
+  Apply(axis, runs, -1);
+  runs.clear();
+  size_t begin = 0;
+  for (size_t n = 1; n <= length; ++n) {
+    uint8_t depth = items[start + (n - 1)*stride].GetValue();
+    if (n == length || items[start + n*stride].GetValue() != depth) {
+      runs.push_back(HMM::State(depth, n - begin));
+      begin = n;
     }
   }
-  for (size_t i = 0; i < a->yinitial.size(); ++i) {
-    json_object_array_add(initial, json_object_new_double(a->yinitial[i]));
+  Apply(axis, runs, 1);
+}
+
+template <typename T> IncrementalHMMGroup::Ptr IncrementalHMMGroup::New(T *items, size_t *dimensions) {
+  IncrementalHMMGroup::Ptr retval(new IncrementalHMMGroup());
+  copy(dimensions, dimensions + 3, retval->dimensions);
+  size_t x = dimensions[0], y = dimensions[1], z = dimensions[2];
+  if (x < y || y < z) Die("Incremental models need dimensions with x >= y >= z");
+  size_t nlines[] = { y*z, x*z, x*y };
+  for (int axis = 0; axis < 3; ++axis) {
+    retval->lines[axis].resize(nlines[axis]);
+    for (size_t line = 0; line < nlines[axis]; ++line) retval->Scan(items, axis, line);
   }
-  obs = json_object_new_array();
-  for (size_t i = 0; i < a->yobs.size(); ++i) {
-    json_object_array_add(obs, json_object_new_int(a->yobs[i]));
+  return retval;
+}
+
+// items must already hold the new values; changed lists the (i, j, k)
+// coordinates that differ from the last scan.
+template <typename T> void IncrementalHMMGroup::Update(T *items, const vector<array<size_t, 3> > &changed) {
+  size_t y = dimensions[1], z = dimensions[2];
+  vector<size_t> affected[3];
+  for (auto it = changed.begin(); it != changed.end(); it++) {
+    size_t i = (*it)[0], j = (*it)[1], k = (*it)[2];
+    affected[0].push_back(j*z + k);
+    affected[1].push_back(i*z + k);
+    affected[2].push_back(i*y + j);
   }
-  json_object_object_add(obj, "observed", obs);
-  json_object_object_add(obj, "transition", transitions);
-  json_object_object_add(obj, "initial", initial);
-  json_object_object_add(retval, "y", obj);
+  for (int axis = 0; axis < 3; ++axis) {
+    sort(affected[axis].begin(), affected[axis].end());
+    affected[axis].resize(distance(affected[axis].begin(), unique(affected[axis].begin(), affected[axis].end())));
+    for (auto it = affected[axis].begin(); it != affected[axis].end(); it++) Scan(items, axis, *it);
+  }
+}
+
+HMMCounts *IncrementalHMMGroup::GetCounts() { return counts; }
+
+HMMGroup::Ptr IncrementalHMMGroup::Build() { return HMMGroup::FromCounts(counts); }
+
+template <typename T> HMMGroup::Ptr CalculateHMMGroup(T *items, size_t *dimensions, int threads) {
+  HMMCounts counts[6];
+  CountHMMGroup(items, dimensions, threads, counts);
+  return HMMGroup::FromCounts(counts);
+}
+
+struct ShardHeader {
+  char magic[8];
+  uint32_t version, kind, sections;
+};
+
+static const char shard_magic[8] = { 'H', 'M', 'M', 'S', 'H', 'A', 'R', 'D' };
+
+typedef vector<pair<string, uint64_t> > ShardSection;
+
+static void PutKey(string &key, uint64_t value, int bytes) {
+  for (int b = bytes - 1; b >= 0; --b) key.push_back((char) (value >> (8*b)));
+}
+
+static uint64_t GetKey(const string &key, size_t offset, int bytes) {
+  uint64_t retval = 0;
+  for (int b = 0; b < bytes; ++b) retval = (retval << 8) | (uint8_t) key[offset + b];
   return retval;
 }
 
-template <typename T> HMM2D::Ptr Calculate2DHMM(T *items, size_t *coords) {
-  HMM2D::Ptr retval = HMM2D::New();
-  HMM2D::PartialState last_depth = 0;
-  HMM2D::PartialState depth = 0;
-  bool starting = true;
-  bool initial = true;
-  vector<HMM2D::PartialState> xinitial_states;
-  vector<HMM2D::PartialTransition> xtransitions;
-  vector<HMM2D::PartialState> yinitial_states;
-  vector<HMM2D::PartialTransition> ytransitions;
-  for (size_t i = 0; i < coords[0]; ++i) {
-    for (size_t j = 0; j < coords[1]; ++j) {
-      depth = items[i*coords[0] + j].GetValue();
-      if (initial) xinitial_states.push_back(depth);
-      else xtransitions.push_back(HMM2D::PartialTransition(last_depth, depth));
-      retval->states.push_back(depth);
-      last_depth = depth;
-      initial = false;
+static string StateKey(const HMM::State &s) {
+  string key;
+  PutKey(key, s.first, 1);
+  PutKey(key, s.second, 8);
+  return key;
+}
+
+static HMM::State KeyState(const string &key, size_t offset) {
+  return HMM::State(GetKey(key, offset, 1), GetKey(key, offset + 1, 8));
+}
+
+static void WriteShardHeader(ofstream &out, uint32_t kind, uint32_t sections) {
+  ShardHeader header;
+  memcpy(header.magic, shard_magic, sizeof(header.magic));
+  header.version = 1;
+  header.kind = kind;
+  header.sections = sections;
+  out.write((const char *) &header, sizeof(header));
+}
+
+static void WriteShardSection(ofstream &out, uint32_t width, ShardSection &records) {
+  sort(records.begin(), records.end());
+  uint64_t n = records.size();
+  out.write((const char *) &width, sizeof(width));
+  out.write((const char *) &n, sizeof(n));
+  for (auto it = records.begin(); it != records.end(); it++) {
+    out.write(it->first.data(), width);
+    out.write((const char *) &it->second, sizeof(it->second));
+  }
+}
+
+// Reads a shard one section and one record at a time.
+struct ShardReader {
+  ifstream in;
+  ShardHeader header;
+  uint32_t width;
+  uint64_t remaining;
+  string key;
+  uint64_t count;
+  int Open(const char *filename) {
+    in.open(filename, ios::binary);
+    in.read((char *) &header, sizeof(header));
+    return in && !memcmp(header.magic, shard_magic, sizeof(header.magic)) && header.version == 1;
+  }
+  int Section() {
+    in.read((char *) &width, sizeof(width));
+    in.read((char *) &remaining, sizeof(remaining));
+    return !!in;
+  }
+  int Next() {
+    if (!remaining) return 0;
+    remaining--;
+    key.resize(width);
+    in.read(&key[0], width);
+    in.read((char *) &count, sizeof(count));
+    return !!in;
+  }
+};
+
+int WriteShard(const char *filename, HMMCounts *counts) {
+  ofstream out(filename, ios::binary);
+  WriteShardHeader(out, SHARD_RUNS, 18);
+  for (size_t m = 0; m < 6; ++m) {
+    ShardSection states, initial, transitions;
+    for (auto it = counts[m].states.begin(); it != counts[m].states.end(); it++) {
+      states.push_back(make_pair(StateKey(it->first), (uint64_t) it->second));
     }
-    initial = true;
-  }
-  for (size_t i = 0; i < coords[1]; ++i) {
-    for (size_t j = 0; j < coords[0]; ++j) {
-      depth = items[j*coords[0] + i].GetValue();
-      if (initial) yinitial_states.push_back(depth);
-      else ytransitions.push_back(HMM2D::PartialTransition(last_depth, depth));
-      last_depth = depth;
-      initial = false;
+    for (auto it = counts[m].initial.begin(); it != counts[m].initial.end(); it++) {
+      initial.push_back(make_pair(StateKey(it->first), (uint64_t) it->second));
     }
-    initial = true;
-  }
-  sort(retval->states.begin(), retval->states.end());
-  auto it = unique(retval->states.begin(), retval->states.end());
-  retval->states.resize(distance(retval->states.begin(), it));
-  retval->xtransition.resize(retval->states.size() * retval->states.size());
-  retval->ytransition.resize(retval->states.size() * retval->states.size());
-  retval->xinitial.resize(retval->states.size());
-  retval->yinitial.resize(retval->states.size());
-  fill(retval->xtransition.begin(), retval->xtransition.end(), 0);
-  fill(retval->ytransition.begin(), retval->ytransition.end(), 0);
-  fill(retval->xinitial.begin(), retval->xinitial.end(), 0);
-  fill(retval->yinitial.begin(), retval->yinitial.end(), 0);
-  for (auto it = retval->states.begin(); it != retval->states.end(); it++) {
-    retval->state_map[*it] = distance(retval->states.begin(), it);
-  }
-  for (auto it = xtransitions.begin(); it != xtransitions.end(); it++) {
-    retval->xtransition[retval->state_map[it->first]*retval->states.size() + retval->state_map[it->second]]++;
-  }
-  for (auto it = retval->xtransition.begin(); it != retval->xtransition.end(); it++) {
-    retval->xtransitionwhole.push_back(*it);
-  }
-  for (size_t j = 0; j < retval->states.size(); ++j) {
-      double sum = 0;
-      for (size_t i = 0; i < retval->states.size(); i++) {
-        sum += retval->xtransitionwhole[i*retval->states.size() + j];
+    for (auto it = counts[m].transitions.begin(); it != counts[m].transitions.end(); it++) {
+      transitions.push_back(make_pair(StateKey(it->first.first) + StateKey(it->first.second), (uint64_t) it->second));
+    }
+    WriteShardSection(out, 9, states);
+    WriteShardSection(out, 9, initial);
+    WriteShardSection(out, 18, transitions);
+  }
+  out.close();
+  return !!out;
+}
+
+int WriteShard(const char *filename, HMM2DCounts *counts) {
+  ofstream out(filename, ios::binary);
+  WriteShardHeader(out, SHARD_2D, 5);
+  uint32_t *vectors[] = { counts->seen, counts->xinitial, counts->yinitial };
+  for (size_t t = 0; t < 3; ++t) {
+    ShardSection records;
+    for (size_t v = 0; v < 256; ++v) {
+      if (!vectors[t][v]) continue;
+      string key;
+      PutKey(key, v, 1);
+      records.push_back(make_pair(key, (uint64_t) vectors[t][v]));
+    }
+    WriteShardSection(out, 1, records);
+  }
+  uint32_t (*matrices[])[256] = { counts->xtransition, counts->ytransition };
+  for (size_t t = 0; t < 2; ++t) {
+    ShardSection records;
+    for (size_t v = 0; v < 256; ++v) {
+      for (size_t w = 0; w < 256; ++w) {
+        if (!matrices[t][v][w]) continue;
+        string key;
+        PutKey(key, v, 1);
+        PutKey(key, w, 1);
+        records.push_back(make_pair(key, (uint64_t) matrices[t][v][w]));
       }
-      retval->xcolsums.push_back(sum);
+    }
+    WriteShardSection(out, 2, records);
+  }
+  out.close();
+  return !!out;
+}
+
+int ShardKind(const char *filename) {
+  ShardReader reader;
+  if (!reader.Open(filename)) return 0;
+  return reader.header.kind;
+}
+
+int ReadShard(const char *filename, HMMCounts *counts) {
+  ShardReader reader;
+  if (!reader.Open(filename) || reader.header.kind != SHARD_RUNS || reader.header.sections != 18) return 0;
+  for (size_t m = 0; m < 6; ++m) {
+    if (!reader.Section()) return 0;
+    while (reader.Next()) counts[m].AddState(KeyState(reader.key, 0), reader.count);
+    if (!reader.Section()) return 0;
+    while (reader.Next()) counts[m].AddInitial(KeyState(reader.key, 0), reader.count);
+    if (!reader.Section()) return 0;
+    while (reader.Next()) counts[m].AddTransition(KeyState(reader.key, 0), KeyState(reader.key, 9), reader.count);
+  }
+  return !!reader.in;
+}
+
+int ReadShard(const char *filename, HMM2DTotals *counts) {
+  ShardReader reader;
+  if (!reader.Open(filename) || reader.header.kind != SHARD_2D || reader.header.sections != 5) return 0;
+  uint64_t *vectors[] = { counts->seen, counts->xinitial, counts->yinitial };
+  for (size_t t = 0; t < 3; ++t) {
+    if (!reader.Section()) return 0;
+    while (reader.Next()) vectors[t][GetKey(reader.key, 0, 1)] += reader.count;
+  }
+  uint64_t (*matrices[])[256] = { counts->xtransition, counts->ytransition };
+  for (size_t t = 0; t < 2; ++t) {
+    if (!reader.Section()) return 0;
+    while (reader.Next()) matrices[t][GetKey(reader.key, 0, 1)][GetKey(reader.key, 1, 1)] += reader.count;
+  }
+  return !!reader.in;
+}
+
+// Sums the inputs section by section into output. Every input is read
+// front to back exactly once, keeping a single record per input in memory.
+int MergeShards(const char *output, const vector<char *> &inputs) {
+  if (inputs.empty()) Die("Must supply shards to merge");
+  vector<unique_ptr<ShardReader> > readers;
+  for (auto it = inputs.begin(); it != inputs.end(); it++) {
+    readers.push_back(unique_ptr<ShardReader>(new ShardReader()));
+    if (!readers.back()->Open(*it)) Die("%s is not a count shard", *it);
+    if (readers.back()->header.kind != readers[0]->header.kind || readers.back()->header.sections != readers[0]->header.sections) {
+      Die("%s does not hold the same kind of counts as %s", *it, inputs[0]);
+    }
   }
-  for (size_t i = 0; i < retval->states.size(); ++i) {
-    double sum = 0;
-    for (size_t j = 0; j < retval->states.size(); ++j) {
-      sum += retval->xtransition[i*retval->states.size() + j];
+  ofstream out(output, ios::binary);
+  WriteShardHeader(out, readers[0]->header.kind, readers[0]->header.sections);
+  auto later = [&] (size_t a, size_t b) { return readers[a]->key > readers[b]->key; };
+  for (uint32_t section = 0; section < readers[0]->header.sections; ++section) {
+    vector<size_t> heap;
+    for (size_t r = 0; r < readers.size(); ++r) {
+      if (!readers[r]->Section()) Die("%s is truncated", inputs[r]);
+      if (readers[r]->width != readers[0]->width) Die("%s does not hold the same kind of counts as %s", inputs[r], inputs[0]);
+      if (readers[r]->Next()) heap.push_back(r);
+    }
+    make_heap(heap.begin(), heap.end(), later);
+    uint32_t width = readers[0]->width;
+    uint64_t n = 0;
+    out.write((const char *) &width, sizeof(width));
+    streampos count_at = out.tellp();
+    out.write((const char *) &n, sizeof(n));
+    while (!heap.empty()) {
+      string key = readers[heap.front()]->key;
+      uint64_t count = 0;
+      while (!heap.empty() && readers[heap.front()]->key == key) {
+        pop_heap(heap.begin(), heap.end(), later);
+        size_t r = heap.back();
+        count += readers[r]->count;
+        if (readers[r]->Next()) push_heap(heap.begin(), heap.end(), later);
+        else heap.pop_back();
+      }
+      out.write(key.data(), width);
+      out.write((const char *) &count, sizeof(count));
+      n++;
     }
-    retval->xrowsums.push_back(sum);
-    if (sum) for (size_t j = 0; j < retval->states.size(); ++j) {
-      retval->xtransition[i*retval->states.size() + j] /= sum;
+    streampos end = out.tellp();
+    out.seekp(count_at);
+    out.write((const char *) &n, sizeof(n));
+    out.seekp(end);
+  }
+  out.close();
+  return !!out;
+}
+
+static const char model_magic[8] = { 'V', 'O', 'X', 'M', 'O', 'D', 'E', 'L' };
+
+static uint64_t Align64(uint64_t offset) { return (offset + 63) & ~(uint64_t) 63; }
+
+struct ModelPayload {
+  ModelBlock block;
+  const void *data;
+};
+
+static void AddPayload(vector<ModelPayload> &payloads, uint32_t type, uint32_t direction, const void *data, uint64_t count, uint64_t width) {
+  ModelPayload payload;
+  payload.block.type = type;
+  payload.block.direction = direction;
+  payload.block.offset = 0;
+  payload.block.count = count;
+  payload.block.size = count*width;
+  payload.data = data;
+  payloads.push_back(payload);
+}
+
+static int WriteModelBlocks(const char *filename, uint32_t kind, vector<ModelPayload> &payloads) {
+  ModelHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, model_magic, sizeof(header.magic));
+  header.version = MODEL_VERSION;
+  header.kind = kind;
+  header.blocks = payloads.size();
+  header.long_double_size = sizeof(long double);
+  uint64_t offset = Align64(sizeof(header) + payloads.size()*sizeof(ModelBlock));
+  for (auto it = payloads.begin(); it != payloads.end(); it++) {
+    it->block.offset = offset;
+    offset = Align64(offset + it->block.size);
+  }
+  ofstream out(filename, ios::binary);
+  out.write((const char *) &header, sizeof(header));
+  for (auto it = payloads.begin(); it != payloads.end(); it++) out.write((const char *) &it->block, sizeof(ModelBlock));
+  static const char zeros[64] = { 0 };
+  uint64_t written = sizeof(header) + payloads.size()*sizeof(ModelBlock);
+  for (auto it = payloads.begin(); it != payloads.end(); it++) {
+    out.write(zeros, it->block.offset - written);
+    out.write((const char *) it->data, it->block.size);
+    written = it->block.offset + it->block.size;
+  }
+  out.close();
+  return !!out;
+}
+
+int WriteModel(const char *filename, HMMGroup::Ptr group) {
+  HMM::Ptr hmms[] = { group->xpos, group->xneg, group->ypos, group->yneg, group->zpos, group->zneg };
+  vector<ModelPayload> payloads;
+  vector<uint8_t> densities[6];
+  vector<uint64_t> durations[6];
+  vector<double> initials[6];
+  for (uint32_t d = 0; d < 6; ++d) {
+    HMM::Ptr m = hmms[d];
+    size_t n = m->states.size();
+    for (auto it = m->states.begin(); it != m->states.end(); it++) {
+      densities[d].push_back(it->first);
+      durations[d].push_back(it->second);
     }
+    initials[d].assign(n, 0);
+    for (size_t k = m->initial.offsets[0]; k < m->initial.offsets[1]; ++k) initials[d][m->initial.columns[k]] = m->initial.values[k];
+    AddPayload(payloads, ModelBlock::Density, d, densities[d].data(), n, sizeof(uint8_t));
+    AddPayload(payloads, ModelBlock::Duration, d, durations[d].data(), n, sizeof(uint64_t));
+    AddPayload(payloads, ModelBlock::Offsets, d, m->matrix.offsets.data(), m->matrix.offsets.size(), sizeof(uint64_t));
+    AddPayload(payloads, ModelBlock::Columns, d, m->matrix.columns.data(), m->matrix.columns.size(), sizeof(uint32_t));
+    AddPayload(payloads, ModelBlock::Values, d, m->matrix.values.data(), m->matrix.values.size(), sizeof(double));
+    AddPayload(payloads, ModelBlock::Initial, d, initials[d].data(), n, sizeof(double));
+  }
+  return WriteModelBlocks(filename, MODEL_HMM_GROUP, payloads);
+}
+
+int WriteModel(const char *filename, HMM2D::Ptr hmm) {
+  size_t n = hmm->states.size();
+  vector<ModelPayload> payloads;
+  vector<uint64_t> states(hmm->states.begin(), hmm->states.end());
+  vector<long double> transitions[] = {
+    vector<long double>(hmm->xtransition.begin(), hmm->xtransition.end()),
+    vector<long double>(hmm->ytransition.begin(), hmm->ytransition.end())
+  };
+  vector<long double> initials[] = {
+    vector<long double>(hmm->xinitial.begin(), hmm->xinitial.end()),
+    vector<long double>(hmm->yinitial.begin(), hmm->yinitial.end())
+  };
+  vector<uint64_t> observations[] = {
+    vector<uint64_t>(hmm->xobs.begin(), hmm->xobs.end()),
+    vector<uint64_t>(hmm->yobs.begin(), hmm->yobs.end())
+  };
+  AddPayload(payloads, ModelBlock::States, 0, states.data(), n, sizeof(uint64_t));
+  for (uint32_t d = 0; d < 2; ++d) {
+    AddPayload(payloads, ModelBlock::Dense, d, transitions[d].data(), n*n, sizeof(long double));
+    AddPayload(payloads, ModelBlock::Initial, d, initials[d].data(), n, sizeof(long double));
+    AddPayload(payloads, ModelBlock::Observations, d, observations[d].data(), observations[d].size(), sizeof(uint64_t));
+  }
+  return WriteModelBlocks(filename, MODEL_HMM2D, payloads);
+}
+
+int WriteModel(const char *filename, HMM3D::Ptr hmm) {
+  size_t n = hmm->states.size();
+  vector<ModelPayload> payloads;
+  vector<double> *transitions[] = { &hmm->xtransition, &hmm->ytransition, &hmm->ztransition };
+  vector<double> *initials[] = { &hmm->xinitial, &hmm->yinitial, &hmm->zinitial };
+  vector<uint64_t> observations[] = {
+    vector<uint64_t>(hmm->xobs.begin(), hmm->xobs.end()),
+    vector<uint64_t>(hmm->yobs.begin(), hmm->yobs.end()),
+    vector<uint64_t>(hmm->zobs.begin(), hmm->zobs.end())
+  };
+  AddPayload(payloads, ModelBlock::Density, 0, hmm->states.data(), n, sizeof(uint8_t));
+  for (uint32_t d = 0; d < 3; ++d) {
+    AddPayload(payloads, ModelBlock::Dense, d, transitions[d]->data(), n*n, sizeof(double));
+    AddPayload(payloads, ModelBlock::Initial, d, initials[d]->data(), n, sizeof(double));
+    AddPayload(payloads, ModelBlock::Observations, d, observations[d].data(), observations[d].size(), sizeof(uint64_t));
+  }
+  return WriteModelBlocks(filename, MODEL_HMM3D, payloads);
+}
+
+ModelFile::Ptr ModelFile::Open(const char *filename) {
+  ModelFile::Ptr retval(new ModelFile());
+  retval->file = MappedFile::Open(filename);
+  const char *base = (const char *) retval->file->GetBuffer();
+  size_t size = retval->file->GetSize();
+  retval->header = (const ModelHeader *) base;
+  if (size < sizeof(ModelHeader) || memcmp(retval->header->magic, model_magic, sizeof(model_magic))) Die("%s is not a model file", filename);
+  if (retval->header->version != MODEL_VERSION) Die("%s is model version %u, expected %u", filename, retval->header->version, MODEL_VERSION);
+  if (retval->header->long_double_size != sizeof(long double)) Die("%s was written on a platform with a different long double", filename);
+  if (retval->header->blocks > (size - sizeof(ModelHeader))/sizeof(ModelBlock)) Die("%s is truncated", filename);
+  retval->blocks = (const ModelBlock *) (base + sizeof(ModelHeader));
+  for (uint32_t b = 0; b < retval->header->blocks; ++b) {
+    const ModelBlock &block = retval->blocks[b];
+    if (block.offset % 64 || block.offset > size || block.size > size - block.offset) Die("%s is truncated", filename);
   }
-  for (auto it = xinitial_states.begin(); it != xinitial_states.end(); it++) {
-    retval->xinitial[retval->state_map[*it]]++;
+  return retval;
+}
+
+uint32_t ModelFile::GetKind() { return header->kind; }
+
+const ModelBlock &ModelFile::Find(uint32_t type, uint32_t direction) {
+  for (uint32_t b = 0; b < header->blocks; ++b) {
+    if (blocks[b].type == type && blocks[b].direction == direction) return blocks[b];
   }
-  double sum = 0;
-  for (size_t i = 0; i < retval->states.size(); ++i) {
-    sum += retval->xinitial[i];
+  Die("Model file is missing block %u of direction %u", type, direction);
+  return blocks[0];
+}
+
+// Checks that the block holds exactly count elements of width bytes before
+// handing out its payload.
+const void *ModelFile::Payload(uint32_t type, uint32_t direction, uint64_t count, uint64_t width) {
+  const ModelBlock &block = Find(type, direction);
+  if (block.count != count || count > block.size/width || block.size != count*width) Die("Model file block %u of direction %u has the wrong size", type, direction);
+  return (const char *) file->GetBuffer() + block.offset;
+}
+
+// The returned hmm2d_t owns only its small headers; the matrices, vectors
+// and observations point into the mapping, which must outlive it. Release
+// it with FreeHMM2DView.
+hmm2d_t *ModelFile::GetHMM2D() {
+  if (header->kind != MODEL_HMM2D) Die("Model file does not hold a 2D HMM");
+  hmm2d_t *retval = init_hmm2d();
+  size_t n = retval->n = Find(ModelBlock::States, 0).count;
+  if (n && n > file->GetSize()/n) Die("Model file block %u of direction %u has the wrong size", (uint32_t) ModelBlock::Dense, 0u);
+  retval->states = (size_t *) Payload(ModelBlock::States, 0, n, sizeof(uint64_t));
+  matrix_t **matrices[] = { &retval->ax, &retval->ay };
+  vector_t **initials[] = { &retval->pix, &retval->piy };
+  obs_vector_t **observations[] = { &retval->xobs, &retval->yobs };
+  for (uint32_t d = 0; d < 2; ++d) {
+    matrix_t *m = (matrix_t *) calloc(1, sizeof(matrix_t));
+    m->data = (long double *) Payload(ModelBlock::Dense, d, n*n, sizeof(long double));
+    m->x = m->y = retval->n;
+    *matrices[d] = m;
+    vector_t *v = (vector_t *) calloc(1, sizeof(vector_t));
+    v->data = (long double *) Payload(ModelBlock::Initial, d, n, sizeof(long double));
+    v->len = retval->n;
+    *initials[d] = v;
+    obs_vector_t *o = (obs_vector_t *) calloc(1, sizeof(obs_vector_t));
+    o->len = Find(ModelBlock::Observations, d).count;
+    if (!o->len) Die("Model file has no observations in direction %u", d);
+    o->data = (size_t *) Payload(ModelBlock::Observations, d, o->len, sizeof(uint64_t));
+    *observations[d] = o;
   }
-  if (sum) for (size_t i = 0; i < retval->states.size(); ++i) {
-    retval->xinitial[i] /= sum;
+  return retval;
+}
+
+void FreeHMM2DView(hmm2d_t *hmm) {
+  free(hmm->ax);
+  free(hmm->ay);
+  free(hmm->pix);
+  free(hmm->piy);
+  free(hmm->xobs);
+  free(hmm->yobs);
+  free(hmm->lax);
+  free(hmm->lay);
+  free(hmm->scores);
+  free(hmm);
+}
+
+HSMM::Ptr HSMM::New() { return HSMM::Ptr(new HSMM); }
+
+// Collapses (density, duration) run counts onto density states: transition
+// and initial counts are summed over durations, and every run's length is
+// counted into its density's duration distribution.
+HSMM::Ptr HSMM::FromCounts(const HMMCounts &counts) {
+  HSMM::Ptr retval = HSMM::New();
+  size_t state_map[256];
+  retval->max_duration = 0;
+  for (auto it = counts.states.begin(); it != counts.states.end(); it++) {
+    retval->states.push_back(it->first.first);
+    retval->max_duration = max(retval->max_duration, it->first.second);
   }
-  for (auto it = ytransitions.begin(); it != ytransitions.end(); it++) {
-    retval->ytransition[retval->state_map[it->first]*retval->states.size() + retval->state_map[it->second]]++;
+  sort(retval->states.begin(), retval->states.end());
+  retval->states.resize(distance(retval->states.begin(), unique(retval->states.begin(), retval->states.end())));
+  size_t n = retval->states.size();
+  for (size_t i = 0; i < n; ++i) state_map[retval->states[i]] = i;
+  retval->matrix.assign(n*n, 0);
+  retval->initial.assign(n, 0);
+  retval->duration.assign(n*retval->max_duration, 0);
+  for (auto it = counts.transitions.begin(); it != counts.transitions.end(); it++) {
+    retval->matrix[state_map[it->first.first.first]*n + state_map[it->first.second.first]] += it->second;
+  }
+  for (auto it = counts.initial.begin(); it != counts.initial.end(); it++) {
+    retval->initial[state_map[it->first.first]] += it->second;
+  }
+  for (auto it = counts.states.begin(); it != counts.states.end(); it++) {
+    retval->duration[state_map[it->first.first]*retval->max_duration + it->first.second - 1] += it->second;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    double sum = 0, dsum = 0;
+    for (size_t j = 0; j < n; ++j) sum += retval->matrix[i*n + j];
+    if (sum) for (size_t j = 0; j < n; ++j) retval->matrix[i*n + j] /= sum;
+    for (size_t d = 0; d < retval->max_duration; ++d) dsum += retval->duration[i*retval->max_duration + d];
+    if (dsum) for (size_t d = 0; d < retval->max_duration; ++d) retval->duration[i*retval->max_duration + d] /= dsum;
   }
-  for (auto it = retval->ytransition.begin(); it != retval->ytransition.end(); it++) {
-    retval->ytransitionwhole.push_back(*it);
+  double sum = 0;
+  for (size_t i = 0; i < n; ++i) sum += retval->initial[i];
+  if (sum) for (size_t i = 0; i < n; ++i) retval->initial[i] /= sum;
+  return retval;
+}
+
+json_object *HSMM::as_json_object() {
+  size_t n = states.size();
+  json_object *retval = json_object_new_object();
+  json_object *state_index = json_object_new_array();
+  for (auto it = states.begin(); it != states.end(); it++) {
+    json_object_array_add(state_index, json_object_new_int(*it));
   }
-  for (size_t j = 0; j < retval->states.size(); ++j) {
-    double sum = 0;
-    for (size_t i = 0; i < retval->states.size(); ++i) {
-      sum += retval->ytransitionwhole[i*retval->states.size() + j];
-    }
-    retval->ycolsums.push_back(sum);
+  json_object_object_add(retval, "states", state_index);
+  json_object *initial_states = json_object_new_array();
+  for (auto it = initial.begin(); it != initial.end(); it++) {
+    json_object_array_add(initial_states, NewDoubleOrInt(*it));
   }
-  for (size_t i = 0; i < retval->states.size(); ++i) {
-    double sum = 0;
-    for (size_t j = 0; j < retval->states.size(); ++j) {
-      sum += retval->ytransition[i*retval->states.size() + j];
+  json_object_object_add(retval, "initial", initial_states);
+  json_object *matrix_array = json_object_new_array();
+  json_object *duration_array = json_object_new_array();
+  for (size_t i = 0; i < n; ++i) {
+    json_object *row = json_object_new_array();
+    for (size_t j = 0; j < n; ++j) {
+      json_object_array_add(row, NewDoubleOrInt(matrix[i*n + j]));
     }
-    retval->yrowsums.push_back(sum);
-    if (sum) for (size_t j = 0; j < retval->states.size(); ++j) {
-      retval->ytransition[i*retval->states.size() + j] /= sum;
+    json_object_array_add(matrix_array, row);
+    row = json_object_new_array();
+    for (size_t d = 0; d < max_duration; ++d) {
+      json_object_array_add(row, NewDoubleOrInt(duration[i*max_duration + d]));
     }
+    json_object_array_add(duration_array, row);
   }
-  for (auto it = yinitial_states.begin(); it != yinitial_states.end(); it++) {
-    retval->yinitial[retval->state_map[*it]]++;
-  }
-  sum = 0;
-  for (size_t i = 0; i < retval->states.size(); ++i) {
-    sum += retval->yinitial[i];
-  }
-  if (sum) for (size_t i = 0; i < retval->states.size(); ++i) {
-    retval->yinitial[i] /= sum;
-  }
+  json_object_object_add(retval, "matrix", matrix_array);
+  json_object_object_add(retval, "durations", duration_array);
   return retval;
 }
 
-template <typename T> HMMGroup::Ptr CalculateHMMGroup(T *items, size_t *dimensions) {
-  HMMGroup::Ptr retval = HMMGroup::New();
-  retval->xpos = CalculateHMM(items, dimensions, 0, 0);
-  retval->xneg = CalculateHMM(items, dimensions, 0, 1);
-  retval->ypos = CalculateHMM(items, dimensions, 1, 0);
-  retval->yneg = CalculateHMM(items, dimensions, 1, 1);
-  retval->zpos = CalculateHMM(items, dimensions, 2, 0);
-  retval->zneg = CalculateHMM(items, dimensions, 2, 1);
+void HSMM::Write(JsonWriter &out) {
+  size_t n = states.size();
+  out.BeginObject();
+  out.Key("states");
+  out.BeginArray();
+  for (auto it = states.begin(); it != states.end(); it++) out.Int(*it);
+  out.EndArray();
+  out.Key("initial");
+  if (out.IsSparse()) {
+    WriteTriplets(out, initial, 1, n);
+    out.Key("matrix");
+    WriteTriplets(out, matrix, n, n);
+    out.Key("durations");
+    WriteTriplets(out, duration, n, max_duration);
+    out.EndObject();
+    return;
+  }
+  out.BeginArray();
+  for (auto it = initial.begin(); it != initial.end(); it++) out.DoubleOrInt(*it);
+  out.EndArray();
+  out.Key("matrix");
+  out.BeginArray();
+  for (size_t i = 0; i < n; ++i) {
+    out.BeginArray();
+    for (size_t j = 0; j < n; ++j) out.DoubleOrInt(matrix[i*n + j]);
+    out.EndArray();
+  }
+  out.EndArray();
+  out.Key("durations");
+  out.BeginArray();
+  for (size_t i = 0; i < n; ++i) {
+    out.BeginArray();
+    for (size_t d = 0; d < max_duration; ++d) out.DoubleOrInt(duration[i*max_duration + d]);
+    out.EndArray();
+  }
+  out.EndArray();
+  out.EndObject();
+}
+
+HSMMGroup::Ptr HSMMGroup::New() { return HSMMGroup::Ptr(new HSMMGroup); }
+
+HSMMGroup::Ptr HSMMGroup::FromCounts(HMMCounts *counts) {
+  HSMMGroup::Ptr retval = HSMMGroup::New();
+  retval->xpos = HSMM::FromCounts(counts[0]);
+  retval->xneg = HSMM::FromCounts(counts[1]);
+  retval->ypos = HSMM::FromCounts(counts[2]);
+  retval->yneg = HSMM::FromCounts(counts[3]);
+  retval->zpos = HSMM::FromCounts(counts[4]);
+  retval->zneg = HSMM::FromCounts(counts[5]);
+  return retval;
+}
+
+json_object *HSMMGroup::as_json_object() {
+  json_object *retval = json_object_new_object();
+  json_object_object_add(retval, "xpos", xpos->as_json_object());
+  json_object_object_add(retval, "xneg", xneg->as_json_object());
+  json_object_object_add(retval, "ypos", ypos->as_json_object());
+  json_object_object_add(retval, "yneg", yneg->as_json_object());
+  json_object_object_add(retval, "zpos", zpos->as_json_object());
+  json_object_object_add(retval, "zneg", zneg->as_json_object());
+  return retval;
+}
+
+void HSMMGroup::Write(JsonWriter &out) {
+  out.BeginObject();
+  out.Key("xpos");
+  xpos->Write(out);
+  out.Key("xneg");
+  xneg->Write(out);
+  out.Key("ypos");
+  ypos->Write(out);
+  out.Key("yneg");
+  yneg->Write(out);
+  out.Key("zpos");
+  zpos->Write(out);
+  out.Key("zneg");
+  zneg->Write(out);
+  out.EndObject();
+}
+
+// Explicit-duration Viterbi in log space. delta[t][j] scores the best
+// segmentation of obs[0, t) whose last segment is state j ending at t, and
+// entry[t][j] the best way to start a segment of j at t, i.e. the initial
+// probability at t = 0 and max_i delta[t][i] + log a_ij after that. Each
+// step costs n^2 for the entries plus n * max_duration for the segment
+// lengths, instead of the square of the (density, duration) product space.
+// Observations index m->obs; with no emission matrix every observation is
+// equally likely and only the length of obs matters. A segment covering an
+// observation its state cannot emit is skipped. path receives the decoded
+// (density, duration) segments in order.
+double ViterbiHSMM(HSMM::Ptr m, const vector<HMM::Observation> &obs, vector<HMM::State> &path) {
+  const double impossible = -numeric_limits<double>::infinity();
+  size_t n = m->states.size(), T = obs.size(), D = m->max_duration;
+  path.clear();
+  if (!n || !T) return impossible;
+  vector<double> loga(n*n), logp(n*D), cumulative(n*(T + 1), 0);
+  vector<uint32_t> zeros(n*(T + 1), 0);
+  for (size_t i = 0; i < n*n; ++i) loga[i] = log(m->matrix[i]);
+  for (size_t i = 0; i < n*D; ++i) logp[i] = log(m->duration[i]);
+  if (!m->emit.empty()) for (size_t j = 0; j < n; ++j) {
+    for (size_t t = 0; t < T; ++t) {
+      double p = m->emit[j*m->obs.size() + obs[t]];
+      cumulative[j*(T + 1) + t + 1] = cumulative[j*(T + 1) + t] + (p > 0 ? log(p) : 0);
+      zeros[j*(T + 1) + t + 1] = zeros[j*(T + 1) + t] + !(p > 0);
+    }
+  }
+  vector<double> delta(n*(T + 1), impossible), entry(n*T, impossible);
+  vector<uint32_t> from(n*T, 0), length(n*(T + 1), 0);
+  for (size_t j = 0; j < n; ++j) entry[j] = log(m->initial[j]);
+  for (size_t t = 1; t <= T; ++t) {
+    for (size_t j = 0; j < n; ++j) {
+      double best = impossible;
+      for (size_t d = 1; d <= min(D, t); ++d) {
+        if (zeros[j*(T + 1) + t] != zeros[j*(T + 1) + t - d]) continue;
+        double score = entry[(t - d)*n + j] + logp[j*D + d - 1] + cumulative[j*(T + 1) + t] - cumulative[j*(T + 1) + t - d];
+        if (score > best) {
+          best = score;
+          length[t*n + j] = d;
+        }
+      }
+      delta[t*n + j] = best;
+    }
+    if (t == T) break;
+    for (size_t j = 0; j < n; ++j) {
+      for (size_t i = 0; i < n; ++i) {
+        double score = delta[t*n + i] + loga[i*n + j];
+        if (score > entry[t*n + j]) {
+          entry[t*n + j] = score;
+          from[t*n + j] = i;
+        }
+      }
+    }
+  }
+  size_t j = 0;
+  for (size_t i = 1; i < n; ++i) {
+    if (delta[T*n + i] > delta[T*n + j]) j = i;
+  }
+  double retval = delta[T*n + j];
+  if (retval == impossible) return retval;
+  for (size_t t = T; t > 0;) {
+    size_t d = length[t*n + j];
+    path.push_back(HMM::State(m->states[j], d));
+    t -= d;
+    if (t) j = from[t*n + j];
+  }
+  reverse(path.begin(), path.end());
   return retval;
 }
 
@@ -887,6 +2773,30 @@ vector<HMM2D::Observation> &HMM2D::GetObservations(HMM2D::Direction d) {
   else return yobs;
 }
 
+HMM3D::Ptr HMM3D::New() {
+  return HMM3D::Ptr(new HMM3D());
+}
+
+vector<double> &HMM3D::GetTransition(HMM3D::Direction d) {
+  if (d == HMM3D::Direction::X) return xtransition;
+  else if (d == HMM3D::Direction::Y) return ytransition;
+  else return ztransition;
+}
+
+vector<double> &HMM3D::GetInitial(HMM3D::Direction d) {
+  if (d == HMM3D::Direction::X) return xinitial;
+  else if (d == HMM3D::Direction::Y) return yinitial;
+  else return zinitial;
+}
+
+vector<HMM3D::Observation> &HMM3D::GetObservations(HMM3D::Direction d) {
+  if (d == HMM3D::Direction::X) return xobs;
+  else if (d == HMM3D::Direction::Y) return yobs;
+  else return zobs;
+}
+
+// Raw little-endian dump: the state count, the states, then the initial
+// vector and row-major transition matrix of x, y and z as doubles.
 Permutation *EMMax(HMM2D::Ptr a, HMM2D::Direction d, size_t len, double threshold) {
   Permutation *result = new Permutation();
   result->probability = 100;
@@ -933,63 +2843,760 @@ Permutation *EM(HMM2D::Ptr a, HMM2D::Direction d, size_t len, HMM2D::PartialStat
 ViterbiResult::ViterbiResult(ViterbiResult *plast, HMM::State *pptr, double pprobability) : last(plast), ptr(pptr), probability(pprobability) {}
 ViterbiResult::~ViterbiResult() { if (last) delete last; }
 
-ViterbiResult *Viterbi(HMM::Ptr m, const vector<HMM::Observation> &obs, size_t len, HMM::State *s, ViterbiResult *last) {
-  size_t idx = s - &m->states[0];
-  if (len == 0) {
-    return new ViterbiResult(nullptr, s, m->emit[idx*m->obs.size() + obs[0]]*m->initial[idx]);
+// One step of the Viterbi recursion in the max-plus semiring:
+// out[j] = max_i delta[i] + columns[j*n + i], with from[j] the first i that
+// attains it. Transitions are stored column-major so every output state reads
+// one contiguous column, which is what lets the inner loop vectorize.
+typedef void (*MaxPlusKernel)(const double *, const double *, size_t, size_t, double *, uint32_t *);
+
+static void MaxPlusScalar(const double *delta, const double *columns, size_t n, size_t m, double *out, uint32_t *from) {
+  for (size_t j = 0; j < m; ++j) {
+    const double *column = columns + j*n;
+    double best = -numeric_limits<double>::infinity();
+    uint32_t arg = 0;
+    for (size_t i = 0; i < n; ++i) {
+      double score = delta[i] + column[i];
+      if (score > best) {
+        best = score;
+        arg = i;
+      }
+    }
+    out[j] = best;
+    from[j] = arg;
   }
-  double max = 0;
-  HMM::State *state = nullptr;
-  ViterbiResult *previous = nullptr;
-  for (auto it = m->states.begin(); it != m->states.end(); it++) {
-    auto idx = distance(m->states.begin(), it);
-    ViterbiResult *result = Viterbi(m, obs, len - 1, &*it, last);
-    double prob = m->emit[idx*m->obs.size() + obs[len]]*m->matrix[distance(m->states.begin(), it)*m->states.size() + distance(m->states.begin(), find(m->states.begin(), m->states.end(), *result->ptr))] * result->probability;
-    if (!previous) {
-      max = prob;
-      state = &*it;
-      previous = result;
-    } else if (prob > max) {
-      delete previous;
-      max = prob;
-      state = &*it;
-      previous = result;
-    } else {
-      delete result;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Folds the per-lane maxima together and finishes the columns' tail. Lanes
+// only ever hold their own first maximum, so ties go to the smaller index.
+static inline void MaxPlusReduce(const double *lanes, const double *args, size_t width, const double *delta, const double *column, size_t i, size_t n, double *out, uint32_t *from) {
+  double best = lanes[0], arg = args[0];
+  for (size_t l = 1; l < width; ++l) {
+    if (lanes[l] > best || (lanes[l] == best && args[l] < arg)) {
+      best = lanes[l];
+      arg = args[l];
+    }
+  }
+  for (; i < n; ++i) {
+    double score = delta[i] + column[i];
+    if (score > best) {
+      best = score;
+      arg = i;
     }
   }
-  return new ViterbiResult(previous, state, max);
+  *out = best;
+  *from = (uint32_t) arg;
+}
+
+__attribute__((target("avx2")))
+static void MaxPlusAVX2(const double *delta, const double *columns, size_t n, size_t m, double *out, uint32_t *from) {
+  for (size_t j = 0; j < m; ++j) {
+    const double *column = columns + j*n;
+    __m256d best = _mm256_set1_pd(-numeric_limits<double>::infinity());
+    __m256d arg = _mm256_setzero_pd(), index = _mm256_setr_pd(0, 1, 2, 3), step = _mm256_set1_pd(4);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      __m256d score = _mm256_add_pd(_mm256_loadu_pd(delta + i), _mm256_loadu_pd(column + i));
+      __m256d greater = _mm256_cmp_pd(score, best, _CMP_GT_OQ);
+      best = _mm256_blendv_pd(best, score, greater);
+      arg = _mm256_blendv_pd(arg, index, greater);
+      index = _mm256_add_pd(index, step);
+    }
+    double lanes[4], args[4];
+    _mm256_storeu_pd(lanes, best);
+    _mm256_storeu_pd(args, arg);
+    MaxPlusReduce(lanes, args, 4, delta, column, i, n, out + j, from + j);
+  }
+}
+
+__attribute__((target("sse4.1")))
+static void MaxPlusSSE4(const double *delta, const double *columns, size_t n, size_t m, double *out, uint32_t *from) {
+  for (size_t j = 0; j < m; ++j) {
+    const double *column = columns + j*n;
+    __m128d best = _mm_set1_pd(-numeric_limits<double>::infinity());
+    __m128d arg = _mm_setzero_pd(), index = _mm_setr_pd(0, 1), step = _mm_set1_pd(2);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+      __m128d score = _mm_add_pd(_mm_loadu_pd(delta + i), _mm_loadu_pd(column + i));
+      __m128d greater = _mm_cmpgt_pd(score, best);
+      best = _mm_blendv_pd(best, score, greater);
+      arg = _mm_blendv_pd(arg, index, greater);
+      index = _mm_add_pd(index, step);
+    }
+    double lanes[2], args[2];
+    _mm_storeu_pd(lanes, best);
+    _mm_storeu_pd(args, arg);
+    MaxPlusReduce(lanes, args, 2, delta, column, i, n, out + j, from + j);
+  }
+}
+#endif
+
+enum SimdLevel { SIMD_NONE, SIMD_SSE4, SIMD_AVX2 };
+
+static SimdLevel GetSimdLevel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse4.1")) return SIMD_SSE4;
+#endif
+  return SIMD_NONE;
+}
+
+static MaxPlusKernel SelectMaxPlus() {
+#if defined(__x86_64__) || defined(__i386__)
+  switch (GetSimdLevel()) {
+    case SIMD_AVX2: return MaxPlusAVX2;
+    case SIMD_SSE4: return MaxPlusSSE4;
+    default: break;
+  }
+#endif
+  return MaxPlusScalar;
+}
+
+extern "C" void max_plus(const double *delta, const double *columns, size_t n, size_t m, double *out, uint32_t *from) {
+  static const MaxPlusKernel kernel = SelectMaxPlus();
+  kernel(delta, columns, n, m, out, from);
+}
+
+ViterbiModel::Ptr ViterbiModel::New(const HMM &m) {
+  const double impossible = -numeric_limits<double>::infinity();
+  ViterbiModel::Ptr retval(new ViterbiModel());
+  size_t n = m.states.size(), nnz = m.matrix.values.size();
+  retval->n = n;
+  retval->nobs = m.obs.size();
+  retval->starts.assign(n + 1, 0);
+  for (size_t k = 0; k < nnz; ++k) retval->starts[m.matrix.columns[k] + 1]++;
+  for (size_t j = 0; j < n; ++j) retval->starts[j + 1] += retval->starts[j];
+  retval->rows.resize(nnz);
+  retval->values.resize(nnz);
+  vector<size_t> cursor(retval->starts.begin(), retval->starts.end() - 1);
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t k = m.matrix.offsets[i]; k < m.matrix.offsets[i + 1]; ++k) {
+      size_t at = cursor[m.matrix.columns[k]]++;
+      retval->rows[at] = i;
+      retval->values[at] = log(m.matrix.values[k]);
+    }
+  }
+  if (n && n*n <= 4*nnz) {
+    retval->columns.assign(n*n, impossible);
+    for (size_t j = 0; j < n; ++j) {
+      for (size_t k = retval->starts[j]; k < retval->starts[j + 1]; ++k) retval->columns[j*n + retval->rows[k]] = retval->values[k];
+    }
+  }
+  retval->initial.assign(n, impossible);
+  for (size_t k = m.initial.offsets[0]; k < m.initial.offsets[1]; ++k) retval->initial[m.initial.columns[k]] = log(m.initial.values[k]);
+  retval->emit.resize(m.emit.size());
+  for (size_t k = 0; k < m.emit.size(); ++k) retval->emit[k] = log(m.emit[k]);
+  fill(retval->obs_ids, retval->obs_ids + 256, retval->nobs);
+  for (size_t o = m.obs.size(); o-- > 0;) retval->obs_ids[m.obs[o]] = o;
+  return retval;
 }
 
-ViterbiResult *ViterbiMax(HMM::Ptr m, vector<HMM::Observation> &obs) {
-  for (auto it = obs.begin(); it != obs.end(); it++) {
-    *it = distance(m->obs.begin(), find(m->obs.begin(), m->obs.end(), *it));
+ViterbiDecoder::ViterbiDecoder(ViterbiModel::Ptr m) : model(m) {}
+
+// Advances delta by step t, the best predecessor of every state going to
+// from: the max-plus kernel over dense columns, or a walk of each column's
+// nonzeros in row order, which breaks ties the same way.
+void ViterbiDecoder::Step(const HMM::Observation *obs, size_t t, uint32_t *from) {
+  const ViterbiModel &m = *model;
+  if (!m.columns.empty()) max_plus(&delta[0], &m.columns[0], m.n, m.n, &next[0], from);
+  else for (size_t j = 0; j < m.n; ++j) {
+    double best = -numeric_limits<double>::infinity();
+    uint32_t arg = 0;
+    for (size_t k = m.starts[j]; k < m.starts[j + 1]; ++k) {
+      double score = delta[m.rows[k]] + m.values[k];
+      if (score > best) {
+        best = score;
+        arg = m.rows[k];
+      }
+    }
+    next[j] = best;
+    from[j] = arg;
+  }
+  if (!m.emit.empty()) for (size_t j = 0; j < m.n; ++j) next[j] += m.emit[j*m.nobs + obs[t]];
+  delta.swap(next);
+}
+
+size_t viterbi_memory_budget = VITERBI_MEMORY_BUDGET;
+
+// Trellis Viterbi: delta holds the best log score of every state at the
+// current step and one row of back is kept per step for the traceback, so
+// the cost is O(T * nnz) <= O(T * N^2). When the T x N table of back would
+// outgrow viterbi_memory_budget, only delta is kept, every sqrt(T) steps,
+// and the rows of back are recomputed one segment at a time during the
+// traceback: O(sqrt(T) * N) memory for about twice the work.
+double ViterbiDecoder::Decode(const HMM::Observation *obs, size_t T, uint32_t *path, uint32_t end) {
+  const double impossible = -numeric_limits<double>::infinity();
+  const ViterbiModel &m = *model;
+  size_t n = m.n;
+  if (!n) return impossible;
+  if (!T) return 0;
+  delta.assign(m.initial.begin(), m.initial.end());
+  next.resize(n);
+  if (!m.emit.empty()) for (size_t j = 0; j < n; ++j) delta[j] += m.emit[j*m.nobs + obs[0]];
+  size_t stride = T;
+  if (T*n*sizeof(uint32_t) > viterbi_memory_budget) stride = max((size_t) 1, (size_t) ceil(sqrt((double) T)));
+  if (back.size() < stride*n) back.resize(stride*n);
+  checkpoints.clear();
+  if (stride == T) {
+    for (size_t t = 1; t < T; ++t) Step(obs, t, &back[t*n]);
+  } else {
+    for (size_t t = 1; t < T; ++t) {
+      if (!((t - 1) % stride)) checkpoints.insert(checkpoints.end(), delta.begin(), delta.end());
+      Step(obs, t, &back[0]);
+    }
+  }
+  size_t best = end == VITERBI_ANY_END ? 0 : end;
+  if (end == VITERBI_ANY_END) {
+    for (size_t j = 1; j < n; ++j) {
+      if (delta[j] > delta[best]) best = j;
+    }
+  }
+  double score = delta[best];
+  if (score == impossible) return impossible;
+  path[T - 1] = best;
+  if (stride == T) {
+    for (size_t t = T - 1; t > 0; --t) path[t - 1] = back[t*n + path[t]];
+  } else {
+    // Segment s covers steps (s*stride, (s + 1)*stride] and restarts from
+    // the delta checkpointed at step s*stride.
+    for (size_t t = T - 1; t > 0;) {
+      size_t s = (t - 1)/stride, first = s*stride;
+      copy(checkpoints.begin() + s*n, checkpoints.begin() + (s + 1)*n, delta.begin());
+      for (size_t u = first + 1; u <= t; ++u) Step(obs, u, &back[(u - first - 1)*n]);
+      for (; t > first; --t) path[t - 1] = back[(t - first - 1)*n + path[t]];
+    }
   }
-  return ViterbiMax(m, obs, obs.size() - 1, nullptr);
+  return score;
 }
 
-ViterbiResult *ViterbiMax(HMM::Ptr m, const vector<HMM::Observation> &obs, size_t len, ViterbiResult *last) {
-  double max = 0;
-  HMM::State *s = nullptr;
-  ViterbiResult *previous = nullptr;
+// Decodes obs[0, len] (indices into m->obs), optionally forced to finish in
+// end. Without an emission matrix every observation is equally likely. path
+// receives state indices and the log probability of the path is returned
+// (-infinity and an empty path if impossible).
+double ViterbiPath(HMM::Ptr m, const vector<HMM::Observation> &obs, size_t len, vector<uint32_t> &path, const HMM::State *end) {
+  path.clear();
+  if (m->states.empty() || obs.size() < len + 1) return -numeric_limits<double>::infinity();
+  ViterbiDecoder decoder(ViterbiModel::New(*m));
+  path.resize(len + 1);
+  double score = decoder.Decode(&obs[0], len + 1, &path[0], end ? end - &m->states[0] : VITERBI_ANY_END);
+  if (score == -numeric_limits<double>::infinity()) path.clear();
+  return score;
+}
+
+// Links the decoded path into the ViterbiResult chain the callers expect:
+// the head is the last step and every node carries the probability of the
+// path up to it.
+static ViterbiResult *ViterbiChain(HMM::Ptr m, const vector<HMM::Observation> &obs, const vector<uint32_t> &path) {
   ViterbiResult *retval = nullptr;
-  for (auto it = m->states.begin(); it != m->states.end(); it++) {
-    ViterbiResult *result = Viterbi(m, obs, len - 1, &*it, last);
-    double prob = m->emit[distance(m->states.begin(), it)*m->obs.size() + obs[len]]*m->matrix[distance(m->states.begin(), it)*m->states.size() + distance(m->states.begin(), find(m->states.begin(), m->states.end(), *result->ptr))] * result->probability;
-    if (!previous) {
-      max = prob;
-      s = &*it;
-      previous = result;
-    } else if (prob > max) {
-      delete previous;
-      max = prob;
-      s = &*it;
-      previous = result;
+  double score = 0;
+  for (size_t t = 0; t < path.size(); ++t) {
+    uint32_t j = path[t];
+    score += log(t ? m->matrix.Get(path[t - 1], j) : m->initial.Get(0, j));
+    if (!m->emit.empty()) score += log(m->emit[j*m->obs.size() + obs[t]]);
+    retval = new ViterbiResult(retval, &m->states[j], exp(score));
+  }
+  return retval;
+}
+
+ViterbiResult *Viterbi(HMM::Ptr m, const vector<HMM::Observation> &obs, size_t len, HMM::State *s, ViterbiResult *last) {
+  vector<uint32_t> path;
+  ViterbiPath(m, obs, len, path, s);
+  return ViterbiChain(m, obs, path);
+}
+
+ViterbiResult *ViterbiMax(HMM::Ptr m, vector<HMM::Observation> &obs) {
+  ViterbiModel::Ptr model = ViterbiModel::New(*m);
+  for (auto it = obs.begin(); it != obs.end(); it++) *it = model->obs_ids[*it];
+  vector<uint32_t> path(obs.size());
+  if (obs.empty() || ViterbiDecoder(model).Decode(&obs[0], obs.size(), &path[0]) == -numeric_limits<double>::infinity()) path.clear();
+  return ViterbiChain(m, obs, path);
+}
+
+ViterbiResult *ViterbiMax(HMM::Ptr m, const vector<HMM::Observation> &obs, size_t len, ViterbiResult *last) {
+  vector<uint32_t> path;
+  ViterbiPath(m, obs, len, path, nullptr);
+  return ViterbiChain(m, obs, path);
+}
+
+// Batch step of the lane decoder: every one of the VITERBI_LANES lanes holds
+// a different sequence, delta is state-major with the lanes innermost, and
+// out/from receive each lane's best predecessor among one column's nonzeros.
+typedef void (*BatchKernel)(const double *delta, const uint32_t *rows, const double *values, size_t nnz, double *out, uint32_t *from);
+
+static void BatchStepScalar(const double *delta, const uint32_t *rows, const double *values, size_t nnz, double *out, uint32_t *from) {
+  for (size_t l = 0; l < VITERBI_LANES; ++l) {
+    out[l] = -numeric_limits<double>::infinity();
+    from[l] = 0;
+  }
+  for (size_t k = 0; k < nnz; ++k) {
+    const double *d = delta + rows[k]*VITERBI_LANES;
+    for (size_t l = 0; l < VITERBI_LANES; ++l) {
+      double score = d[l] + values[k];
+      if (score > out[l]) {
+        out[l] = score;
+        from[l] = rows[k];
+      }
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Two accumulators over alternating nonzeros break the compare/blend
+// dependency chain; they are merged with ties going to the earlier row.
+__attribute__((target("avx2")))
+static void BatchStepAVX2(const double *delta, const uint32_t *rows, const double *values, size_t nnz, double *out, uint32_t *from) {
+  __m256d even = _mm256_set1_pd(-numeric_limits<double>::infinity()), odd = even;
+  __m256d argeven = _mm256_setzero_pd(), argodd = argeven;
+  size_t k = 0;
+  for (; k + 2 <= nnz; k += 2) {
+    __m256d score = _mm256_add_pd(_mm256_loadu_pd(delta + rows[k]*VITERBI_LANES), _mm256_set1_pd(values[k]));
+    __m256d greater = _mm256_cmp_pd(score, even, _CMP_GT_OQ);
+    even = _mm256_blendv_pd(even, score, greater);
+    argeven = _mm256_blendv_pd(argeven, _mm256_set1_pd(rows[k]), greater);
+    score = _mm256_add_pd(_mm256_loadu_pd(delta + rows[k + 1]*VITERBI_LANES), _mm256_set1_pd(values[k + 1]));
+    greater = _mm256_cmp_pd(score, odd, _CMP_GT_OQ);
+    odd = _mm256_blendv_pd(odd, score, greater);
+    argodd = _mm256_blendv_pd(argodd, _mm256_set1_pd(rows[k + 1]), greater);
+  }
+  if (k < nnz) {
+    __m256d score = _mm256_add_pd(_mm256_loadu_pd(delta + rows[k]*VITERBI_LANES), _mm256_set1_pd(values[k]));
+    __m256d greater = _mm256_cmp_pd(score, even, _CMP_GT_OQ);
+    even = _mm256_blendv_pd(even, score, greater);
+    argeven = _mm256_blendv_pd(argeven, _mm256_set1_pd(rows[k]), greater);
+  }
+  __m256d greater = _mm256_or_pd(_mm256_cmp_pd(odd, even, _CMP_GT_OQ), _mm256_and_pd(_mm256_cmp_pd(odd, even, _CMP_EQ_OQ), _mm256_cmp_pd(argodd, argeven, _CMP_LT_OQ)));
+  _mm256_storeu_pd(out, _mm256_blendv_pd(even, odd, greater));
+  _mm_storeu_si128((__m128i *) from, _mm256_cvtpd_epi32(_mm256_blendv_pd(argeven, argodd, greater)));
+}
+
+__attribute__((target("sse4.1")))
+static void BatchStepSSE4(const double *delta, const uint32_t *rows, const double *values, size_t nnz, double *out, uint32_t *from) {
+  __m128d lo = _mm_set1_pd(-numeric_limits<double>::infinity()), hi = lo;
+  __m128d arglo = _mm_setzero_pd(), arghi = arglo;
+  for (size_t k = 0; k < nnz; ++k) {
+    const double *d = delta + rows[k]*VITERBI_LANES;
+    __m128d value = _mm_set1_pd(values[k]), row = _mm_set1_pd(rows[k]);
+    __m128d score = _mm_add_pd(_mm_loadu_pd(d), value);
+    __m128d greater = _mm_cmpgt_pd(score, lo);
+    lo = _mm_blendv_pd(lo, score, greater);
+    arglo = _mm_blendv_pd(arglo, row, greater);
+    score = _mm_add_pd(_mm_loadu_pd(d + 2), value);
+    greater = _mm_cmpgt_pd(score, hi);
+    hi = _mm_blendv_pd(hi, score, greater);
+    arghi = _mm_blendv_pd(arghi, row, greater);
+  }
+  _mm_storeu_pd(out, lo);
+  _mm_storeu_pd(out + 2, hi);
+  _mm_storel_epi64((__m128i *) from, _mm_cvtpd_epi32(arglo));
+  _mm_storel_epi64((__m128i *) (from + 2), _mm_cvtpd_epi32(arghi));
+}
+#endif
+
+static BatchKernel SelectBatchStep() {
+#if defined(__x86_64__) || defined(__i386__)
+  switch (GetSimdLevel()) {
+    case SIMD_AVX2: return BatchStepAVX2;
+    case SIMD_SSE4: return BatchStepSSE4;
+    default: break;
+  }
+#endif
+  return BatchStepScalar;
+}
+
+// Decodes up to VITERBI_LANES sequences side by side. seqs is ordered longest
+// first, so the whole group runs as long as its first sequence and the others
+// are finished off as they end; idle lanes just compute on observation 0.
+static void ViterbiLanes(const ViterbiModel &b, BatchKernel step, const HMM::Observation *obs, const size_t *offsets, const size_t *seqs, size_t lanes, uint32_t *paths, double *scores, vector<double> &delta, vector<double> &next, vector<uint32_t> &back) {
+  const size_t W = VITERBI_LANES, n = b.n;
+  size_t T = offsets[seqs[0] + 1] - offsets[seqs[0]], length[W] = { 0 };
+  const HMM::Observation *seq[W];
+  for (size_t l = 0; l < lanes; ++l) {
+    seq[l] = obs + offsets[seqs[l]];
+    length[l] = offsets[seqs[l] + 1] - offsets[seqs[l]];
+  }
+  if (!T) return;
+  delta.resize(n*W);
+  next.resize(n*W);
+  back.resize(T*n*W);
+  auto emission = [&] (size_t j, size_t l, size_t t) { return b.emit.empty() || t >= length[l] ? 0 : b.emit[j*b.nobs + seq[l][t]]; };
+  auto finish = [&] (size_t l) {
+    size_t best = 0, len = length[l];
+    for (size_t j = 1; j < n; ++j) {
+      if (delta[j*W + l] > delta[best*W + l]) best = j;
+    }
+    uint32_t *path = paths + offsets[seqs[l]];
+    scores[seqs[l]] = delta[best*W + l];
+    path[len - 1] = best;
+    for (size_t t = len - 1; t > 0; --t) path[t - 1] = back[(t*n + path[t])*W + l];
+  };
+  for (size_t j = 0; j < n; ++j) {
+    for (size_t l = 0; l < W; ++l) delta[j*W + l] = b.initial[j] + emission(j, l, 0);
+  }
+  for (size_t l = 0; l < lanes; ++l) {
+    if (length[l] == 1) finish(l);
+  }
+  for (size_t t = 1; t < T; ++t) {
+    for (size_t j = 0; j < n; ++j) {
+      size_t k = b.starts[j];
+      step(&delta[0], &b.rows[k], &b.values[k], b.starts[j + 1] - k, &next[j*W], &back[(t*n + j)*W]);
+      for (size_t l = 0; l < W; ++l) next[j*W + l] += emission(j, l, t);
+    }
+    delta.swap(next);
+    for (size_t l = 0; l < lanes; ++l) {
+      if (length[l] == t + 1) finish(l);
+    }
+  }
+}
+
+void ViterbiBatch(const HMM &m, const HMM::Observation *obs, const size_t *offsets, size_t count, uint32_t *paths, double *scores, int threads) {
+  const double impossible = -numeric_limits<double>::infinity();
+  for (size_t s = 0; s < count; ++s) scores[s] = m.states.empty() ? impossible : 0;
+  if (m.states.empty() || !count) return;
+  ViterbiModel::Ptr model = ViterbiModel::New(m);
+  BatchKernel step = SelectBatchStep();
+  vector<size_t> order(count);
+  for (size_t s = 0; s < count; ++s) order[s] = s;
+  stable_sort(order.begin(), order.end(), [&] (size_t a, size_t c) { return offsets[a + 1] - offsets[a] > offsets[c + 1] - offsets[c]; });
+  size_t groups = (count + VITERBI_LANES - 1)/VITERBI_LANES;
+  if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+  threads = min((size_t) threads, groups);
+  atomic<size_t> next(0);
+  // A group whose lanes would need more backpointers than
+  // viterbi_memory_budget is decoded a sequence at a time by ViterbiDecoder,
+  // which checkpoints instead.
+  auto worker = [&] () {
+    vector<double> delta, scratch;
+    vector<uint32_t> back;
+    ViterbiDecoder decoder(model);
+    for (size_t g = next++; g < groups; g = next++) {
+      size_t first = g*VITERBI_LANES, lanes = min((size_t) VITERBI_LANES, count - first);
+      size_t T = offsets[order[first] + 1] - offsets[order[first]];
+      if (T*model->n*VITERBI_LANES*sizeof(uint32_t) <= viterbi_memory_budget) {
+        ViterbiLanes(*model, step, obs, offsets, &order[first], lanes, paths, scores, delta, scratch, back);
+        continue;
+      }
+      for (size_t l = 0; l < lanes; ++l) {
+        size_t s = order[first + l];
+        if (offsets[s + 1] > offsets[s]) scores[s] = decoder.Decode(obs + offsets[s], offsets[s + 1] - offsets[s], paths + offsets[s]);
+      }
+    }
+  };
+  vector<thread> pool;
+  for (int t = 0; t < threads; ++t) pool.push_back(thread(worker));
+  for (auto &t : pool) t.join();
+}
+
+// Beam-pruned ViterbiPath: each step keeps its surviving states as cells
+// sorted by state, every cell pointing at its predecessor's cell, so memory
+// and work scale with the beam instead of the state count. With nothing
+// pruned it finds the same path as ViterbiPath, ties included.
+double ViterbiBeam(HMM::Ptr m, const vector<HMM::Observation> &obs, size_t len, const Beam &beam, vector<uint32_t> &path) {
+  const double impossible = -numeric_limits<double>::infinity();
+  size_t n = m->states.size(), T = len + 1, nobs = m->obs.size();
+  path.clear();
+  if (!n || obs.size() < T) return impossible;
+  struct Cell {
+    uint32_t state;
+    size_t from;
+    double score;
+  };
+  auto emission = [&] (size_t j, size_t t) { return m->emit.empty() ? 0 : log(m->emit[j*nobs + obs[t]]); };
+  auto better = [] (const Cell &a, const Cell &b) { return a.score > b.score || (a.score == b.score && a.state < b.state); };
+  vector<double> logv(m->matrix.values.size());
+  for (size_t k = 0; k < logv.size(); ++k) logv[k] = log(m->matrix.values[k]);
+  vector<Cell> cells;
+  vector<double> score(n, impossible);
+  vector<size_t> from(n);
+  vector<uint32_t> touched;
+  size_t first = 0, last = 0;
+  for (size_t t = 0; t < T; ++t) {
+    if (!t) {
+      for (size_t k = m->initial.offsets[0]; k < m->initial.offsets[1]; ++k) {
+        touched.push_back(m->initial.columns[k]);
+        score[m->initial.columns[k]] = log(m->initial.values[k]);
+      }
+    } else for (size_t p = first; p < last; ++p) {
+      size_t i = cells[p].state;
+      for (size_t k = m->matrix.offsets[i]; k < m->matrix.offsets[i + 1]; ++k) {
+        size_t j = m->matrix.columns[k];
+        double s = cells[p].score + logv[k];
+        if (score[j] == impossible) touched.push_back(j);
+        if (s > score[j]) {
+          score[j] = s;
+          from[j] = p;
+        }
+      }
+    }
+    first = last;
+    for (auto j : touched) {
+      double s = score[j] + emission(j, t);
+      if (s != impossible) cells.push_back({ j, from[j], s });
+      score[j] = impossible;
+    }
+    touched.clear();
+    if (beam.width && cells.size() - first > beam.width) {
+      nth_element(cells.begin() + first, cells.begin() + first + beam.width, cells.end(), better);
+      cells.resize(first + beam.width);
+    }
+    if (beam.margin < numeric_limits<double>::infinity() && cells.size() > first) {
+      double best = max_element(cells.begin() + first, cells.end(), [] (const Cell &a, const Cell &b) { return a.score < b.score; })->score;
+      cells.erase(remove_if(cells.begin() + first, cells.end(), [&] (const Cell &c) { return c.score < best - beam.margin; }), cells.end());
+    }
+    sort(cells.begin() + first, cells.end(), [] (const Cell &a, const Cell &b) { return a.state < b.state; });
+    last = cells.size();
+    if (first == last) return impossible;
+  }
+  size_t best = first;
+  for (size_t p = first + 1; p < last; ++p) {
+    if (cells[p].score > cells[best].score) best = p;
+  }
+  path.resize(T);
+  for (size_t t = T, p = best; t > 0; p = cells[p].from) path[--t] = cells[p].state;
+  return cells[best].score;
+}
+
+// Decodes every sequence exactly with ViterbiBatch, then beam-pruned one at
+// a time, counting the sequences whose pruned path scores below the exact
+// one. Both timings are CPU time.
+BeamReport ValidateBeam(HMM::Ptr m, const vector<HMM::Observation> &obs, const vector<size_t> &offsets, const Beam &beam, int threads) {
+  BeamReport report = { 0, 0, 0, 0 };
+  size_t count = offsets.empty() ? 0 : offsets.size() - 1;
+  vector<uint32_t> paths(obs.size()), path;
+  vector<double> scores(count);
+  clock_t start = clock();
+  ViterbiBatch(*m, obs.data(), offsets.data(), count, paths.data(), scores.data(), threads);
+  report.exact_seconds = (double) (clock() - start)/CLOCKS_PER_SEC;
+  for (size_t s = 0; s < count; ++s) {
+    if (offsets[s + 1] == offsets[s]) continue;
+    vector<HMM::Observation> seq(obs.begin() + offsets[s], obs.begin() + offsets[s + 1]);
+    start = clock();
+    double pruned = ViterbiBeam(m, seq, seq.size() - 1, beam, path);
+    report.beam_seconds += (double) (clock() - start)/CLOCKS_PER_SEC;
+    report.sequences++;
+    if (pruned < scores[s]) report.misses++;
+  }
+  return report;
+}
+
+// Scaled forward-backward over obs[0, T): alpha[t*n + j] is the forward
+// probability of state j at step t normalized over j, scale[t] the
+// normalizer, and beta the backward probabilities divided by the same
+// factors, so alpha*beta at a step is already the state posterior. Returns
+// the log likelihood of the sequence (-infinity if impossible).
+double ForwardBackward(const HMM &m, const HMM::Observation *obs, size_t T, vector<double> &alpha, vector<double> &beta, vector<double> &scale) {
+  size_t n = m.states.size(), nobs = m.obs.size();
+  auto emission = [&] (size_t j, size_t t) { return m.emit.empty() ? 1 : m.emit[j*nobs + obs[t]]; };
+  alpha.assign(T*n, 0);
+  beta.assign(T*n, 0);
+  scale.assign(T, 0);
+  if (!T) return 0;
+  double loglik = 0;
+  for (size_t t = 0; t < T; ++t) {
+    double *a = &alpha[t*n];
+    if (!t) {
+      for (size_t k = m.initial.offsets[0]; k < m.initial.offsets[1]; ++k) a[m.initial.columns[k]] = m.initial.values[k];
     } else {
-      delete result;
+      const double *last = &alpha[(t - 1)*n];
+      for (size_t i = 0; i < n; ++i) {
+        if (!last[i]) continue;
+        for (size_t k = m.matrix.offsets[i]; k < m.matrix.offsets[i + 1]; ++k) a[m.matrix.columns[k]] += last[i]*m.matrix.values[k];
+      }
+    }
+    double sum = 0;
+    for (size_t j = 0; j < n; ++j) sum += (a[j] *= emission(j, t));
+    if (!(sum > 0)) return -numeric_limits<double>::infinity();
+    for (size_t j = 0; j < n; ++j) a[j] /= sum;
+    scale[t] = sum;
+    loglik += log(sum);
+  }
+  fill(beta.begin() + (T - 1)*n, beta.end(), 1.0);
+  for (size_t t = T - 1; t > 0; --t) {
+    const double *later = &beta[t*n];
+    double *b = &beta[(t - 1)*n];
+    for (size_t i = 0; i < n; ++i) {
+      double sum = 0;
+      for (size_t k = m.matrix.offsets[i]; k < m.matrix.offsets[i + 1]; ++k) {
+        size_t j = m.matrix.columns[k];
+        sum += m.matrix.values[k]*emission(j, t)*later[j];
+      }
+      b[i] = sum/scale[t];
+    }
+  }
+  return loglik;
+}
+
+// Expected counts of one E step, aligned with the model: transition with
+// the nonzeros of matrix, initial with those of initial.
+struct BaumWelchCounts {
+  vector<double> initial, transition, leaving, emit, occupancy;
+  double loglik;
+  size_t skipped;
+  void Reset(const HMM &m) {
+    initial.assign(m.initial.values.size(), 0);
+    transition.assign(m.matrix.values.size(), 0);
+    leaving.assign(m.states.size(), 0);
+    emit.assign(m.emit.size(), 0);
+    occupancy.assign(m.states.size(), 0);
+    loglik = 0;
+    skipped = 0;
+  }
+  void Merge(const BaumWelchCounts &other) {
+    for (size_t k = 0; k < initial.size(); ++k) initial[k] += other.initial[k];
+    for (size_t k = 0; k < transition.size(); ++k) transition[k] += other.transition[k];
+    for (size_t j = 0; j < leaving.size(); ++j) leaving[j] += other.leaving[j];
+    for (size_t k = 0; k < emit.size(); ++k) emit[k] += other.emit[k];
+    for (size_t j = 0; j < occupancy.size(); ++j) occupancy[j] += other.occupancy[j];
+    loglik += other.loglik;
+    skipped += other.skipped;
+  }
+};
+
+static void BaumWelchExpect(const HMM &m, const HMM::Observation *obs, size_t T, BaumWelchCounts &counts, vector<double> &alpha, vector<double> &beta, vector<double> &scale) {
+  size_t n = m.states.size(), nobs = m.obs.size();
+  double loglik = ForwardBackward(m, obs, T, alpha, beta, scale);
+  if (loglik == -numeric_limits<double>::infinity()) {
+    counts.skipped++;
+    return;
+  }
+  counts.loglik += loglik;
+  for (size_t k = m.initial.offsets[0]; k < m.initial.offsets[1]; ++k) {
+    size_t j = m.initial.columns[k];
+    counts.initial[k] += alpha[j]*beta[j];
+  }
+  for (size_t t = 0; t < T; ++t) {
+    const double *a = &alpha[t*n], *b = &beta[t*n];
+    for (size_t j = 0; j < n; ++j) {
+      double gamma = a[j]*b[j];
+      if (!gamma) continue;
+      counts.occupancy[j] += gamma;
+      if (t + 1 < T) counts.leaving[j] += gamma;
+      if (!m.emit.empty()) counts.emit[j*nobs + obs[t]] += gamma;
+    }
+    if (t + 1 == T) continue;
+    const double *later = &beta[(t + 1)*n];
+    for (size_t i = 0; i < n; ++i) {
+      if (!a[i]) continue;
+      for (size_t k = m.matrix.offsets[i]; k < m.matrix.offsets[i + 1]; ++k) {
+        size_t j = m.matrix.columns[k];
+        double e = m.emit.empty() ? 1 : m.emit[j*nobs + obs[t + 1]];
+        counts.transition[k] += a[i]*m.matrix.values[k]*e*later[j]/scale[t + 1];
+      }
+    }
+  }
+}
+
+// Baum-Welch re-estimation of m from the packed sequences. Every iteration
+// sums expected counts over chunks of BAUM_WELCH_CHUNK sequences, threads
+// taking one chunk each per round, and adds the chunks up in order, so the
+// result does not depend on the thread count. Only nonzero parameters are
+// re-estimated and states never visited keep their rows. Returns the total
+// log likelihood under the model of the last E step, with the sequences the
+// model cannot produce, which are left out, counted in impossible.
+double BaumWelch(HMM::Ptr m, const vector<HMM::Observation> &obs, const vector<size_t> &offsets, int iterations, int threads, size_t *impossible) {
+  size_t count = offsets.empty() ? 0 : offsets.size() - 1, n = m->states.size(), nobs = m->obs.size();
+  size_t chunks = (count + BAUM_WELCH_CHUNK - 1)/BAUM_WELCH_CHUNK;
+  if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+  threads = max((size_t) 1, min((size_t) threads, chunks));
+  vector<BaumWelchCounts> counts(threads);
+  BaumWelchCounts total;
+  double loglik = 0;
+  for (int iteration = 0; iteration < iterations; ++iteration) {
+    total.Reset(*m);
+    for (size_t first = 0; first < chunks; first += threads) {
+      size_t round = min((size_t) threads, chunks - first);
+      vector<thread> pool;
+      for (size_t t = 0; t < round; ++t) {
+        pool.push_back(thread([&, t] () {
+          vector<double> alpha, beta, scale;
+          size_t c = first + t;
+          counts[t].Reset(*m);
+          for (size_t s = c*BAUM_WELCH_CHUNK; s < min(count, (c + 1)*BAUM_WELCH_CHUNK); ++s) {
+            if (offsets[s + 1] > offsets[s]) BaumWelchExpect(*m, &obs[offsets[s]], offsets[s + 1] - offsets[s], counts[t], alpha, beta, scale);
+          }
+        }));
+      }
+      for (auto &t : pool) t.join();
+      for (size_t t = 0; t < round; ++t) total.Merge(counts[t]);
+    }
+    loglik = total.loglik;
+    if (impossible) *impossible = total.skipped;
+    double starts = 0;
+    for (auto c : total.initial) starts += c;
+    if (starts > 0) {
+      for (size_t k = 0; k < total.initial.size(); ++k) m->initial.values[k] = total.initial[k]/starts;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      if (!(total.leaving[i] > 0)) continue;
+      for (size_t k = m->matrix.offsets[i]; k < m->matrix.offsets[i + 1]; ++k) m->matrix.values[k] = total.transition[k]/total.leaving[i];
+    }
+    if (!m->emit.empty()) for (size_t j = 0; j < n; ++j) {
+      if (!(total.occupancy[j] > 0)) continue;
+      for (size_t o = 0; o < nobs; ++o) m->emit[j*nobs + o] = total.emit[j*nobs + o]/total.occupancy[j];
     }
   }
-  return new ViterbiResult(previous, s, max);
+  return loglik;
+}
+
+// Makes every run state emit its own density, observations being the 256
+// density values, so BaumWelch can learn run durations from sequences of
+// run densities alone.
+void SeedRunEmissions(HMM::Ptr m) {
+  m->obs.resize(256);
+  for (size_t o = 0; o < 256; ++o) m->obs[o] = o;
+  m->emit.assign(m->states.size()*256, 0);
+  for (size_t j = 0; j < m->states.size(); ++j) m->emit[j*256 + m->states[j].first] = 1;
+}
+
+void SeedRunEmissions(HSMM::Ptr m) {
+  m->obs.resize(256);
+  for (size_t o = 0; o < 256; ++o) m->obs[o] = o;
+  m->emit.assign(m->states.size()*256, 0);
+  for (size_t j = 0; j < m->states.size(); ++j) m->emit[j*256 + m->states[j]] = 1;
+}
+
+// Log likelihood of the best segmentation of every sequence under m, summed
+// over the sequences ViterbiHSMM can decode; the rest are counted in
+// impossible.
+double ScoreHSMM(HSMM::Ptr m, const vector<HMM::Observation> &obs, const vector<size_t> &offsets, size_t *impossible) {
+  double retval = 0;
+  vector<HMM::Observation> seq;
+  vector<HMM::State> path;
+  *impossible = 0;
+  for (size_t s = 0; s + 1 < offsets.size(); ++s) {
+    seq.assign(obs.begin() + offsets[s], obs.begin() + offsets[s + 1]);
+    double score = ViterbiHSMM(m, seq, path);
+    if (score == -numeric_limits<double>::infinity()) ++*impossible;
+    else retval += score;
+  }
+  return retval;
+}
+
+// The densities along every line of an axis (0 for x, 1 for y, 2 for z),
+// one packed sequence per line and back to front with backward. With runs
+// every run collapses to one observation: what the run models of
+// CountHMMGroup see with the durations hidden.
+template <typename T> void LineSequences(T *items, size_t *dimensions, int axis, bool backward, bool runs, vector<HMM::Observation> &obs, vector<size_t> &offsets) {
+  size_t x = dimensions[0], y = dimensions[1];
+  size_t stride[] = { x*y, y, 1 };
+  int a = (axis + 1) % 3, b = (axis + 2) % 3;
+  obs.clear();
+  offsets.assign(1, 0);
+  for (size_t u = 0; u < dimensions[a]; ++u) {
+    for (size_t v = 0; v < dimensions[b]; ++v) {
+      size_t first = obs.size();
+      for (size_t w = 0; w < dimensions[axis]; ++w) {
+        uint8_t depth = items[u*stride[a] + v*stride[b] + w*stride[axis]].GetValue();
+        if (!runs || obs.size() == first || depth != obs.back()) obs.push_back(depth);
+      }
+      if (backward) reverse(obs.begin() + first, obs.end());
+      offsets.push_back(obs.size());
+    }
+  }
+}
+
+template <typename T> void RunSequences(T *items, size_t *dimensions, int axis, bool backward, vector<HMM::Observation> &obs, vector<size_t> &offsets) {
+  LineSequences(items, dimensions, axis, backward, true, obs, offsets);
 }
 
 json_object *StateToJsonObject(HMM::State s) {
@@ -1024,6 +3631,17 @@ template class PNG<PNG_FORMAT_GA>;
 template void Die<char const*, char const*>(char const*, char const*);
 
 template HMMGroup::Ptr CalculateHMMGroup<PNG<1>::Pixel>(PNG<1>::Pixel*, unsigned long*);
+template HMMGroup::Ptr CalculateHMMGroup<PNG<1>::Pixel>(PNG<1>::Pixel*, unsigned long*, int);
+template void CountHMMGroup<PNG<1>::Pixel>(PNG<1>::Pixel*, unsigned long*, int, HMMCounts*);
+template IncrementalHMMGroup::Ptr IncrementalHMMGroup::New<PNG<1>::Pixel>(PNG<1>::Pixel*, unsigned long*);
+template void IncrementalHMMGroup::Update<PNG<1>::Pixel>(PNG<1>::Pixel*, const vector<array<size_t, 3> >&);
+template HMM3D::Ptr Calculate3DHMM<PNG<1>::Pixel>(PNG<1>::Pixel*, unsigned long*);
+template struct Counts2D<uint32_t>;
+template struct Counts2D<uint64_t>;
+template HMM3D::Ptr Calculate3DHMM<PNG<1>::Pixel>(PNG<1>::Pixel*, unsigned long*, int);
+template void LineSequences<PNG<1>::Pixel>(PNG<1>::Pixel*, unsigned long*, int, bool, bool, vector<HMM::Observation>&, vector<size_t>&);
+template void RunSequences<PNG<1>::Pixel>(PNG<1>::Pixel*, unsigned long*, int, bool, vector<HMM::Observation>&, vector<size_t>&);
+template HSMM::Ptr CalculateHSMM<PNG<1>::Pixel>(PNG<1>::Pixel*, unsigned long*, uint8_t, uint8_t);
 template void Die<char const*>(char const*);
 template void Die<char const*, double>(char const*, double);
 template void Die<char const*, int, char*>(char const*, int, char*);
@@ -1211,94 +3829,118 @@ void HMM2D::Rotate(double d) {
   RowNormalize(this);
 }
 HMM2D::Ptr Calculate2DHMMReverse(PNG<PNG_FORMAT_GA>::Pixel *items, size_t *coords) {
-  HMM2D::Ptr retval = HMM2D::New();
-  HMM2D::PartialState last_depth = 0;
-  HMM2D::PartialState depth = 0;
-  bool starting = true;
-  bool initial = true;
-  vector<HMM2D::PartialState> xinitial_states;
-  vector<HMM2D::PartialTransition> xtransitions;
-  vector<HMM2D::PartialState> yinitial_states;
-  vector<HMM2D::PartialTransition> ytransitions;
-  for (size_t i = coords[0] - 1; i != numeric_limits<size_t>::max(); --i) {
-    for (size_t j = coords[1] - 1; j != numeric_limits<size_t>::max(); --j) {
-      depth = items[i*coords[0] + j].GetValue();
-      if (initial) xinitial_states.push_back(depth);
-      else xtransitions.push_back(HMM2D::PartialTransition(last_depth, depth));
-      retval->states.push_back(depth);
-      last_depth = depth;
-      initial = false;
-    }
-    initial = true;
-  }
-  for (size_t i = coords[1] - 1; i != numeric_limits<size_t>::max(); --i) {
-    for (size_t j = coords[0] - 1; j != numeric_limits<size_t>::max(); --j) {
-      depth = items[j*coords[0] + i].GetValue();
-      if (initial) yinitial_states.push_back(depth);
-      else ytransitions.push_back(HMM2D::PartialTransition(last_depth, depth));
-      last_depth = depth;
-      initial = false;
-    }
-    initial = true;
-  }
-  sort(retval->states.begin(), retval->states.end());
-  auto it = unique(retval->states.begin(), retval->states.end());
-  retval->states.resize(distance(retval->states.begin(), it));
-  retval->xtransition.resize(retval->states.size() * retval->states.size());
-  retval->ytransition.resize(retval->states.size() * retval->states.size());
-  retval->xinitial.resize(retval->states.size());
-  retval->yinitial.resize(retval->states.size());
-  fill(retval->xtransition.begin(), retval->xtransition.end(), 0);
-  fill(retval->ytransition.begin(), retval->ytransition.end(), 0);
-  fill(retval->xinitial.begin(), retval->xinitial.end(), 0);
-  fill(retval->yinitial.begin(), retval->yinitial.end(), 0);
-  for (auto it = retval->states.begin(); it != retval->states.end(); it++) {
-    retval->state_map[*it] = distance(retval->states.begin(), it);
-  }
-  for (auto it = xtransitions.begin(); it != xtransitions.end(); it++) {
-    retval->xtransition[retval->state_map[it->first]*retval->states.size() + retval->state_map[it->second]]++;
-  }
-  for (size_t i = 0; i < retval->states.size(); ++i) {
-    double sum = 0;
-    for (size_t j = 0; j < retval->states.size(); ++j) {
-      sum += retval->xtransition[i*retval->states.size() + j];
-    }
-    if (sum) for (size_t j = 0; j < retval->states.size(); ++j) {
-      retval->xtransition[i*retval->states.size() + j] /= sum;
+  HMM2DCounts::Ptr counts = HMM2DCounts::New();
+  Count2DHMM(items, coords, true, counts.get());
+  return counts->Build(false);
+}
+
+HMM3DCounts::Ptr HMM3DCounts::New() { return HMM3DCounts::Ptr(new HMM3DCounts()); }
+
+// Counts the x planes [i0, i1) in memory order; each voxel's predecessor on
+// every axis is one stride back, so all three axes come out of one sweep.
+template <typename T> void Count3DHMM(T *items, size_t *dimensions, size_t i0, size_t i1, HMM3DCounts *counts) {
+  size_t x = dimensions[0], y = dimensions[1], z = dimensions[2];
+  for (size_t i = i0; i < i1; ++i) {
+    for (size_t j = 0; j < y; ++j) {
+      uint8_t last = 0;
+      for (size_t k = 0; k < z; ++k) {
+        size_t idx = i*x*y + j*y + k;
+        uint8_t depth = items[idx].GetValue();
+        counts->seen[depth]++;
+        if (!i) counts->initial[0][depth]++;
+        else counts->transition[0][items[idx - x*y].GetValue()][depth]++;
+        if (!j) counts->initial[1][depth]++;
+        else counts->transition[1][items[idx - y].GetValue()][depth]++;
+        if (!k) counts->initial[2][depth]++;
+        else counts->transition[2][last][depth]++;
+        last = depth;
+      }
     }
   }
-  for (auto it = xinitial_states.begin(); it != xinitial_states.end(); it++) {
-    retval->xinitial[retval->state_map[*it]]++;
-  }
-  double sum = 0;
-  for (size_t i = 0; i < retval->states.size(); ++i) {
-    sum += retval->xinitial[i];
-  }
-  if (sum) for (size_t i = 0; i < retval->states.size(); ++i) {
-    retval->xinitial[i] /= sum;
-  }
-  for (auto it = ytransitions.begin(); it != ytransitions.end(); it++) {
-    retval->ytransition[retval->state_map[it->first]*retval->states.size() + retval->state_map[it->second]]++;
-  }
-  for (size_t i = 0; i < retval->states.size(); ++i) {
-    double sum = 0;
-    for (size_t j = 0; j < retval->states.size(); ++j) {
-      sum += retval->ytransition[i*retval->states.size() + j];
-    }
-    if (sum) for (size_t j = 0; j < retval->states.size(); ++j) {
-      retval->ytransition[i*retval->states.size() + j] /= sum;
+}
+
+void HMM3DCounts::Merge(const HMM3DCounts &other) {
+  for (size_t v = 0; v < 256; ++v) seen[v] += other.seen[v];
+  for (size_t a = 0; a < 3; ++a) {
+    for (size_t v = 0; v < 256; ++v) {
+      initial[a][v] += other.initial[a][v];
+      for (size_t w = 0; w < 256; ++w) transition[a][v][w] += other.transition[a][v][w];
     }
   }
-  for (auto it = yinitial_states.begin(); it != yinitial_states.end(); it++) {
-    retval->yinitial[retval->state_map[*it]]++;
-  }
-  sum = 0;
-  for (size_t i = 0; i < retval->states.size(); ++i) {
-    sum += retval->yinitial[i];
+}
+
+HMM3D::Ptr HMM3DCounts::Build() {
+  HMM3D::Ptr retval = HMM3D::New();
+  for (size_t v = 0; v < 256; ++v) {
+    if (!seen[v]) continue;
+    retval->state_map[v] = retval->states.size();
+    retval->states.push_back(v);
+  }
+  size_t n = retval->states.size();
+  HMM3D::Direction axes[] = { HMM3D::Direction::X, HMM3D::Direction::Y, HMM3D::Direction::Z };
+  for (size_t a = 0; a < 3; ++a) {
+    vector<double> &matrix = retval->GetTransition(axes[a]);
+    vector<double> &start = retval->GetInitial(axes[a]);
+    matrix.assign(n*n, 0);
+    start.assign(n, 0);
+    double total = 0;
+    for (size_t i = 0; i < n; ++i) {
+      start[i] = initial[a][retval->states[i]];
+      total += start[i];
+      double sum = 0;
+      for (size_t j = 0; j < n; ++j) {
+        matrix[i*n + j] = transition[a][retval->states[i]][retval->states[j]];
+        sum += matrix[i*n + j];
+      }
+      if (sum) for (size_t j = 0; j < n; ++j) matrix[i*n + j] /= sum;
+    }
+    if (total) for (size_t i = 0; i < n; ++i) start[i] /= total;
   }
-  if (sum) for (size_t i = 0; i < retval->states.size(); ++i) {
-    retval->yinitial[i] /= sum;
+  return retval;
+}
+
+// The observations of a 3D model are the summed densities of every plane
+// across each axis, as GenProjections gives the 2D ones per line.
+template <typename T> void GenProjections(T *items, size_t *dimensions, vector<HMM3D::Observation> &xobs, vector<HMM3D::Observation> &yobs, vector<HMM3D::Observation> &zobs) {
+  size_t x = dimensions[0], y = dimensions[1], z = dimensions[2];
+  xobs.assign(x, 0);
+  yobs.assign(y, 0);
+  zobs.assign(z, 0);
+  for (size_t i = 0; i < x; ++i) {
+    for (size_t j = 0; j < y; ++j) {
+      for (size_t k = 0; k < z; ++k) {
+        uint8_t depth = items[i*x*y + j*y + k].GetValue();
+        xobs[i] += depth;
+        yobs[j] += depth;
+        zobs[k] += depth;
+      }
+    }
   }
+}
+
+template <typename T> HMM3D::Ptr Calculate3DHMM(T *items, size_t *dimensions) {
+  HMM3DCounts::Ptr counts = HMM3DCounts::New();
+  Count3DHMM(items, dimensions, 0, dimensions[0], counts.get());
+  HMM3D::Ptr retval = counts->Build();
+  GenProjections(items, dimensions, retval->xobs, retval->yobs, retval->zobs);
+  return retval;
+}
+
+template <typename T> HMM3D::Ptr Calculate3DHMM(T *items, size_t *dimensions, int threads) {
+  if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+  if (threads == 1) return Calculate3DHMM(items, dimensions);
+  vector<HMM3DCounts::Ptr> tables(threads);
+  vector<thread> pool;
+  for (int t = 0; t < threads; ++t) {
+    tables[t] = HMM3DCounts::New();
+    pool.push_back(thread([&, t] () {
+      Count3DHMM(items, dimensions, dimensions[0]*t/threads, dimensions[0]*(t + 1)/threads, tables[t].get());
+    }));
+  }
+  for (auto &t : pool) t.join();
+  for (int t = 1; t < threads; ++t) tables[0]->Merge(*tables[t]);
+  HMM3D::Ptr retval = tables[0]->Build();
+  GenProjections(items, dimensions, retval->xobs, retval->yobs, retval->zobs);
   return retval;
 }
 
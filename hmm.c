@@ -148,10 +148,33 @@ double prob(hmm2d_t *hmm, cache_t *cache, size_t t, size_t k, int isx) {
 	}
 }
 
-  
+/* Index of the state at step t whose probability times its transition into
+   idx is largest, found with the max-plus kernel over log probabilities.
+   Every state at t must already be cached. */
+static size_t best_predecessor(hmm2d_t *hmm, cache_t *cache, size_t t, const double *columns, size_t idx) {
+	size_t i;
+	double best;
+	uint32_t from;
+	for (i = 0; i < hmm->n; ++i) hmm->scores[i] = logl((*cache_el(cache, t, i))->probability);
+	max_plus(hmm->scores, columns + idx*hmm->n, hmm->n, 1, &best, &from);
+	return from;
+}
+
+static double *log_columns(matrix_t *m, size_t n) {
+	size_t i, j;
+	double *retval = (double *) malloc(n*n*sizeof(double));
+	for (j = 0; j < n; ++j) {
+		for (i = 0; i < n; ++i) retval[j*n + i] = logl(*matrix_el(m, i, j));
+	}
+	return retval;
+}
+
+/* Best path into state k at cell t. Each cell scores its emissions times the
+   predecessor maximizing probability times transition, on its own; no
+   candidate is scored against another candidate's result. */
 viterbi2d_result_t *viterbi2d(hmm2d_t *hmm, cache_t *cache, size_t t, size_t k) {
   size_t x, y;
-  long double max, overall;
+  long double overall;
   long idx;
 	int cmp;
   viterbi2d_result_t *xviterbi, *yviterbi, *retval;
@@ -160,7 +183,6 @@ viterbi2d_result_t *viterbi2d(hmm2d_t *hmm, cache_t *cache, size_t t, size_t k)
   if ((retval = *cache_el(cache, t, idx))) {
 		return retval;
 	}
-	max = 0;
   retval = init_viterbi2d_result();
 	retval->probability = prob(hmm, cache, t, k, 1)*prob(hmm, cache, t, k, 0);
   if (t == 0) {
@@ -168,43 +190,45 @@ viterbi2d_result_t *viterbi2d(hmm2d_t *hmm, cache_t *cache, size_t t, size_t k)
     retval->y = k;
     retval->probability = sqrt(retval->probability*(*vector_el(hmm->pix, idx))*(*vector_el(hmm->piy, idx)));
   } else if (t < hmm->xobs->len) {
-    for (x = 0; x < hmm->n; ++x) {
-      xviterbi = viterbi2d(hmm, cache, t - 1, hmm->states[x]);
-      overall = sqrt(retval->probability*xviterbi->probability*(*matrix_el(hmm->ax, x, idx))*(*vector_el(hmm->piy, idx)));
-      if (overall > max || (overall == max && !x)) {
-        retval->lastx = xviterbi;
-        retval->x = x;
-        retval->probability = overall;
-        max = overall;
-      }
-    }
+    for (x = 0; x < hmm->n; ++x) viterbi2d(hmm, cache, t - 1, hmm->states[x]);
+    x = best_predecessor(hmm, cache, t - 1, hmm->lax, idx);
+    xviterbi = *cache_el(cache, t - 1, x);
+    overall = sqrt(retval->probability*xviterbi->probability*(*matrix_el(hmm->ax, x, idx))*(*vector_el(hmm->piy, idx)));
+    if (overall == 0) xviterbi = *cache_el(cache, t - 1, x = 0);
+    retval->lastx = xviterbi;
+    retval->x = x;
+    retval->probability = overall;
   } else if (!(t % hmm->xobs->len)) {
-    for (y = 0; y < hmm->n; ++y) {
-      yviterbi = viterbi2d(hmm, cache, t - hmm->xobs->len, hmm->states[y]);
-      overall = sqrt(retval->probability*yviterbi->probability*(*matrix_el(hmm->ay, y, idx))*(*vector_el(hmm->pix, idx)));
-			if (overall > max || (overall == max && !y)) {
-        retval->lasty = yviterbi;
-        retval->y = y;
-        retval->probability = overall;
-        max = overall;
-      }
-    }
+    for (y = 0; y < hmm->n; ++y) viterbi2d(hmm, cache, t - hmm->xobs->len, hmm->states[y]);
+    y = best_predecessor(hmm, cache, t - hmm->xobs->len, hmm->lay, idx);
+    yviterbi = *cache_el(cache, t - hmm->xobs->len, y);
+    overall = sqrt(retval->probability*yviterbi->probability*(*matrix_el(hmm->ay, y, idx))*(*vector_el(hmm->pix, idx)));
+    if (overall == 0) yviterbi = *cache_el(cache, t - hmm->xobs->len, y = 0);
+    retval->lasty = yviterbi;
+    retval->y = y;
+    retval->probability = overall;
   } else {
+    /* The x and y factors are independent, so the best pair is the best x
+       predecessor with the best y predecessor. Predecessor cells are still
+       filled in row-major pair order, since prob() reads the cache. */
     for (x = 0; x < hmm->n; ++x) {
-      for (y = 0; y < hmm->n; ++y) {
-        xviterbi = viterbi2d(hmm, cache, t - 1, hmm->states[x]);
-        yviterbi = viterbi2d(hmm, cache, t - hmm->xobs->len, hmm->states[y]);
-				overall = sqrt(retval->probability*xviterbi->probability*(*matrix_el(hmm->ax, x, idx))*yviterbi->probability*(*matrix_el(hmm->ay, y, idx)));
-        if (overall > max || (overall == max && !x && !y)) {
-          retval->lastx = xviterbi;
-          retval->lasty = yviterbi;
-          retval->x = x;
-          retval->y = y;
-          retval->probability = overall;
-					max = overall;
-        }
-      }
+      viterbi2d(hmm, cache, t - 1, hmm->states[x]);
+      if (!x) for (y = 0; y < hmm->n; ++y) viterbi2d(hmm, cache, t - hmm->xobs->len, hmm->states[y]);
+    }
+    x = best_predecessor(hmm, cache, t - 1, hmm->lax, idx);
+    y = best_predecessor(hmm, cache, t - hmm->xobs->len, hmm->lay, idx);
+    xviterbi = *cache_el(cache, t - 1, x);
+    yviterbi = *cache_el(cache, t - hmm->xobs->len, y);
+    overall = sqrt(retval->probability*xviterbi->probability*(*matrix_el(hmm->ax, x, idx))*yviterbi->probability*(*matrix_el(hmm->ay, y, idx)));
+    if (overall == 0) {
+      xviterbi = *cache_el(cache, t - 1, x = 0);
+      yviterbi = *cache_el(cache, t - hmm->xobs->len, y = 0);
     }
+    retval->lastx = xviterbi;
+    retval->lasty = yviterbi;
+    retval->x = x;
+    retval->y = y;
+    retval->probability = overall;
   }
   cache_put(cache, t, idx, retval);
   return retval;
@@ -218,6 +242,11 @@ viterbi2d_result_t *viterbi2d_max(hmm2d_t *hmm, cache_t **cache) {
 	max = 0;
   len = hmm->xobs->len*hmm->yobs->len - 1;
   *cache = init_cache(len, hmm->n);
+  if (!hmm->lax) {
+    hmm->lax = log_columns(hmm->ax, hmm->n);
+    hmm->lay = log_columns(hmm->ay, hmm->n);
+    hmm->scores = (double *) malloc(hmm->n*sizeof(double));
+  }
   for (x = 0; x < hmm->n; ++x) {
     result = viterbi2d(hmm, *cache, len, hmm->states[x]);
     if (result->probability > max || (result->probability == max && !x)) {
@@ -232,34 +261,60 @@ hmm2d_t *init_hmm2d() {
   memset(retval, 0, sizeof(hmm2d_t));
   return retval;
 }
-void print_hmm(hmm2d_t *hmm) {
+
+/* Formats a double the way json-c does, so print_hmm can stream its output
+   instead of building a json_object per matrix cell. */
+static void print_json_double(double d) {
+	char buf[64];
+	if (isnan(d)) strcpy(buf, "NaN");
+	else if (isinf(d)) strcpy(buf, d < 0 ? "-Infinity" : "Infinity");
+	else {
+		snprintf(buf, sizeof(buf), "%.17g", d);
+		if (!strpbrk(buf, ".eE")) strcat(buf, ".0");
+	}
+	fputs(buf, stdout);
+}
+
+static void print_json_vector(const char *key, vector_t *vec, size_t n, int first) {
+	size_t i;
+	printf("%s \"%s\": [", first ? "" : ",", key);
+	for (i = 0; i < n; ++i) {
+		printf("%s ", i ? "," : "");
+		print_json_double((double) *vector_el(vec, i));
+	}
+	printf(" ]");
+}
+
+static void print_json_matrix(const char *key, matrix_t *m, size_t n) {
 	size_t i, j;
-	json_object *retval, *xrow, *yrow, *pix = json_object_new_array(), *axmatrix = json_object_new_array(), *piy = json_object_new_array(), *aymatrix = json_object_new_array(), *xobs = json_object_new_array(), *yobs = json_object_new_array();
-  retval = json_object_new_object();
-	for (i = 0; i < hmm->n; ++i) {
-		xrow = json_object_new_array();
-		yrow = json_object_new_array();
-		for (j = 0; j < hmm->n; ++j) {
-			json_object_array_add(xrow, json_object_new_double(*matrix_el(hmm->ax, i, j)));
-			json_object_array_add(yrow, json_object_new_double(*matrix_el(hmm->ay, i, j)));
+	printf(", \"%s\": [", key);
+	for (i = 0; i < n; ++i) {
+		printf("%s [", i ? "," : "");
+		for (j = 0; j < n; ++j) {
+			printf("%s ", j ? "," : "");
+			print_json_double((double) *matrix_el(m, i, j));
 		}
-		json_object_array_add(pix, json_object_new_double(*vector_el(hmm->pix, i)));
-		json_object_array_add(piy, json_object_new_double(*vector_el(hmm->piy, i)));
-		json_object_array_add(axmatrix, xrow);
-		json_object_array_add(aymatrix, yrow);
+		printf(" ]");
 	}
-	for (i = 0; i < hmm->xobs->len; ++i) {
-		json_object_array_add(xobs, json_object_new_int(*obs_vector_el(hmm->xobs, i)));
-		json_object_array_add(yobs, json_object_new_int(*obs_vector_el(hmm->yobs, i)));
-	}
-	json_object_object_add(retval, "pix", pix);
-	json_object_object_add(retval, "piy", piy);
-	json_object_object_add(retval, "xtransition", axmatrix);
-	json_object_object_add(retval, "ytransition", aymatrix);
-	json_object_object_add(retval, "xobs", xobs);
-	json_object_object_add(retval, "yobs", yobs);
-	printf("%s", json_object_to_json_string(retval));
-	json_object_put(retval);
+	printf(" ]");
+}
+
+static void print_json_obs(const char *key, obs_vector_t *vec, size_t n) {
+	size_t i;
+	printf(", \"%s\": [", key);
+	for (i = 0; i < n; ++i) printf("%s %d", i ? "," : "", (int) *obs_vector_el(vec, i));
+	printf(" ]");
+}
+
+void print_hmm(hmm2d_t *hmm) {
+	printf("{");
+	print_json_vector("pix", hmm->pix, hmm->n, 1);
+	print_json_vector("piy", hmm->piy, hmm->n, 0);
+	print_json_matrix("xtransition", hmm->ax, hmm->n);
+	print_json_matrix("ytransition", hmm->ay, hmm->n);
+	print_json_obs("xobs", hmm->xobs, hmm->xobs->len);
+	print_json_obs("yobs", hmm->yobs, hmm->xobs->len);
+	printf(" }");
 }
 
 typedef struct _pixel_t {
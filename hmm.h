@@ -37,6 +37,11 @@ typedef struct _hmm2d_t {
   matrix_t *by;
   obs_vector_t *xobs;
   obs_vector_t *yobs;
+  /* column-major log transitions and predecessor scratch for viterbi2d,
+     filled in by viterbi2d_max */
+  double *lax;
+  double *lay;
+  double *scores;
 } hmm2d_t;
 
 #ifdef __cplusplus
@@ -54,6 +59,8 @@ int obs_vector_push(obs_vector_t *vec, size_t el);
 long double *vector_el(vector_t *vec, size_t i);
 size_t *obs_vector_el(obs_vector_t *vec, size_t i);
 
+void max_plus(const double *delta, const double *columns, size_t n, size_t m, double *out, uint32_t *from);
+
 viterbi2d_result_t *init_viterbi2d_result();
 void viterbi2d_free(viterbi2d_result_t *res);
 long state_to_idx(hmm2d_t *hmm, size_t k);
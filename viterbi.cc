@@ -2,6 +2,7 @@
 #include <cmath>
 #include <iostream>
 #include <getopt.h>
+#include <libgen.h>
 #include <json-c/json.h>
 #include "hmm.h"
 #include "cache.h"
@@ -9,25 +10,44 @@ using namespace std;
 typedef enum _mode {
   GENERATE,
   SOLVE,
-  ROTATE
+  ROTATE,
+  SHARD,
+  MERGE
 } the_mode_t;
 
 void woop() {}
 static the_mode_t mode;
 static int dim = 0;
 bool reconstructit = false;
+static char *model_filename = 0;
+static char *save_model_filename = 0;
+static char *load_model_filename = 0;
+static vector<char *> paths;
 int main(int argc, char **argv) {
+  base = basename(argv[0]);
   static struct option long_options[] = {
     {"reconstruct", no_argument, 0, 'r'},
+    {"model", required_argument, 0, 'm'},
+    {"save-model", required_argument, 0, 's'},
+    {"load-model", required_argument, 0, 'l'},
     {0, 0, 0, 0}
   };
   int long_index = 0;
   int c;
-  while ((c = getopt_long(argc, argv, "r", long_options, &long_index)) != -1) {
+  while ((c = getopt_long(argc, argv, "rm:s:l:", long_options, &long_index)) != -1) {
     switch (c) {
       case 'r':
         reconstructit = true;
         break;
+      case 'm':
+        model_filename = optarg;
+        break;
+      case 's':
+        save_model_filename = optarg;
+        break;
+      case 'l':
+        load_model_filename = optarg;
+        break;
     }
   }
   while (optind < argc) {
@@ -40,15 +60,27 @@ int main(int argc, char **argv) {
       mode = SOLVE;
     } else if (!strcmp(argv[optind], "rotate")) {
       mode = ROTATE;
-    }
+    } else if (!strcmp(argv[optind], "shard")) {
+      mode = SHARD;
+    } else if (!strcmp(argv[optind], "merge")) {
+      mode = MERGE;
+    } else paths.push_back(argv[optind]);
     optind++;
   } 
   if (mode == SOLVE) {
-  PNG<PNG_FORMAT_GA> *png = PNG<PNG_FORMAT_GA>::FromFile("out.png");
-  size_t coords[2] = { (size_t) png->GetWidth(), (size_t) png->GetHeight() };
-  HMM2D::Ptr hmm = Calculate2DHMM<PNG<PNG_FORMAT_GA>::Pixel>((PNG<PNG_FORMAT_GA>::Pixel *) png->GetPixelArray(), coords);
-  GenProjections(png, hmm->xobs, hmm->yobs);
-  hmm2d_t *hmmc = HMM2DToC(hmm);
+  ModelFile::Ptr model;
+  hmm2d_t *hmmc;
+  if (load_model_filename) {
+    model = ModelFile::Open(load_model_filename);
+    hmmc = model->GetHMM2D();
+  } else {
+    PNG<PNG_FORMAT_GA> *png = PNG<PNG_FORMAT_GA>::FromFile("out.png");
+    size_t coords[2] = { (size_t) png->GetWidth(), (size_t) png->GetHeight() };
+    HMM2D::Ptr hmm = Calculate2DHMM<PNG<PNG_FORMAT_GA>::Pixel>((PNG<PNG_FORMAT_GA>::Pixel *) png->GetPixelArray(), coords);
+    GenProjections(png, hmm->xobs, hmm->yobs);
+    if (save_model_filename && !WriteModel(save_model_filename, hmm)) { cerr << "viterbi: failed to write " << save_model_filename << endl; exit(1); }
+    hmmc = HMM2DToC(hmm);
+  }
   double start = clock();
   cache_t *cache;
   viterbi2d_result_t *result = viterbi2d_max(hmmc, &cache);
@@ -57,6 +89,35 @@ int main(int argc, char **argv) {
   cache_free(cache);
   woop();
   cout << clock() - start << endl;
+  } else if (mode == SHARD) {
+    if (paths.size() != 2) { cerr << "viterbi: shard takes an image and an output file" << endl; exit(1); }
+    PNG<PNG_FORMAT_GA> *png = PNG<PNG_FORMAT_GA>::FromFile(paths[0]);
+    size_t coords[2] = { (size_t) png->GetWidth(), (size_t) png->GetHeight() };
+    HMM2DCounts::Ptr counts = HMM2DCounts::New();
+    Count2DHMM((PNG<PNG_FORMAT_GA>::Pixel *) png->GetPixelArray(), coords, false, counts.get());
+    if (!WriteShard(paths[1], counts.get())) { cerr << "viterbi: failed to write " << paths[1] << endl; exit(1); }
+    delete png;
+  } else if (mode == MERGE) {
+    if (paths.size() < 2) { cerr << "viterbi: merge takes an output file and one or more shards" << endl; exit(1); }
+    char *output = paths[0];
+    paths.erase(paths.begin());
+    if (!MergeShards(output, paths)) { cerr << "viterbi: failed to write " << output << endl; exit(1); }
+    if (model_filename) {
+      int fd = open(model_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) { cerr << "viterbi: failed to open " << model_filename << endl; exit(1); }
+      JsonWriter out(fd);
+      if (ShardKind(output) == SHARD_2D) {
+        HMM2DTotals::Ptr counts = HMM2DTotals::New();
+        if (!ReadShard(output, counts.get())) { cerr << "viterbi: failed to read " << output << endl; exit(1); }
+        WriteHMM2D(out, counts->Build(true));
+      } else {
+        HMMCounts counts[6];
+        if (!ReadShard(output, counts)) { cerr << "viterbi: failed to read " << output << endl; exit(1); }
+        HMMGroup::FromCounts(counts)->Write(out);
+      }
+      if (!out.Flush()) { cerr << "viterbi: failed to write " << model_filename << endl; exit(1); }
+      close(fd);
+    }
   } else if (mode == ROTATE) {
     cout << M_PI << endl;
     cout << sin(2*M_PI) << endl;
@@ -66,6 +127,10 @@ int main(int argc, char **argv) {
     PNG<PNG_FORMAT_GA> *png = PNG<PNG_FORMAT_GA>::FromFile("out.png");
     size_t coords[2] = { (size_t) png->GetWidth(), (size_t) png->GetHeight() };
     HMM2D::Ptr hmm = Calculate2DHMM<PNG<PNG_FORMAT_GA>::Pixel>((PNG<PNG_FORMAT_GA>::Pixel *) png->GetPixelArray(), coords);
+    if (save_model_filename) {
+      GenProjections(png, hmm->xobs, hmm->yobs);
+      if (!WriteModel(save_model_filename, hmm)) { cerr << "viterbi: failed to write " << save_model_filename << endl; exit(1); }
+    }
     hmm2d_t *hmmc = HMM2DToC(hmm);
     print_hmm(hmmc);
     delete png;
@@ -9,7 +9,6 @@
 #include <getopt.h>
 #include <cmath>
 #include <iostream>
-#include <fstream>
 #include <map>
 #include <png.h>
 #include <libgen.h>
@@ -19,10 +18,13 @@
 
 using namespace std;
 
-const char usage_format_string[] = "Usage: %s [-d dimensions] [-o output] input\nVoxelize a PDB file to voxel space of specified dimensions. Outputs 3D array of densities in JSON.";
+const char usage_format_string[] = "Usage: %s [-d dimensions] [-o output] [-j threads] [-m volume [-b brick]] [--occupancy] [--semi-markov] [--quantize log[:base]|quantile[:bins]] [--min-count n] [--hmm3d file] [--hmm3d-binary file] [--shard file] [--save-model file] [--sparse] [--precision digits|shortest] [--beam k] [--beam-margin logp] [--train iterations] [--frames prefix] [-g[n]] [-l labels] [--channels rule --channel-output file [--interleave]] input\nVoxelize a PDB file to voxel space of specified dimensions. Outputs 3D array of densities in JSON.\n-j sets the worker threads for bricks and HMM construction (default: all cores).\nWith -m the grid is voxelized brick by brick into a disk-backed volume file, resuming any bricks already completed.\nWith --occupancy the grid is stored as a packed bit per voxel.\nWith --semi-markov the -a models are semi-Markov: density states with a duration distribution each, and without --quantize or --occupancy the log likelihood of the best segmentation of every line of the grid under them is reported on stderr.\nWith --quantize the run durations of the -a models are binned, and with --min-count states seen fewer times are merged into their nearest neighbour; the state-count reduction is reported on stderr.\nWith --hmm3d (JSON) or --hmm3d-binary (a binary model file like --save-model) the voxel-to-voxel x, y and z transition models of the grid are written, observing the summed density of every plane across each axis.\nWith --shard the raw run counts behind -a are written as a count shard; shards from many structures are summed with 'viterbi merge'.\nWith --save-model the -a models are written as a binary model file that can be mapped without parsing.\nWith --sparse the -a matrices are written as {\"i\", \"j\", \"v\"} triplets of their nonzero cells, and --precision limits the significant digits of every probability (shortest: the fewest that read back exactly).\nWith --beam (states kept per step) or --beam-margin (log probability below the step's best) the run densities along every line of the grid are decoded under each -a model exactly, in SIMD batches, and beam-pruned, and how often the pruning dropped the best path is reported on stderr.\nWith --frames every further model (frame) of the inputs is voxelized on the grid of the first, and its -a models, updated incrementally from the lines through the voxels that changed, are written to prefix<frame>.json.\nWith --train the -a models are re-estimated by Baum-Welch from the run densities along every line of the grid, run durations hidden, before they are written; the final log likelihoods are reported on stderr.\nWith -g each residue, or every n atoms, is voxelized as one bead at its center of mass.\nWith -l the winning structure of every voxel is written as a raw uint16 label volume plus a label-to-density palette in labels.json.\nWith --channels the atoms are split by chain, element or residue and every channel is voxelized in one pass into a planar (or --interleave'd) uint8 volume.";
 char *output_filename = 0;
 char *input_filename = 0;
 
+
+const char *directions[] = { "xpos", "xneg", "ypos", "yneg", "zpos", "zneg" };
+
 void Usage() {
   Die(usage_format_string);
 }
@@ -42,6 +44,28 @@ int main(int argc, char **argv) {
     {"output", required_argument, 0, 'o'},
     {"radius", required_argument, 0, 'r'},
     {"a-matrix", optional_argument, 0, 'a'},
+    {"map", required_argument, 0, 'm'},
+    {"brick", required_argument, 0, 'b'},
+    {"threads", required_argument, 0, 'j'},
+    {"occupancy", no_argument, 0, 'O'},
+    {"labels", required_argument, 0, 'l'},
+    {"coarse-grain", optional_argument, 0, 'g'},
+    {"semi-markov", no_argument, 0, 'S'},
+    {"quantize", required_argument, 0, 'q'},
+    {"min-count", required_argument, 0, 'k'},
+    {"hmm3d", required_argument, 0, '3'},
+    {"hmm3d-binary", required_argument, 0, '4'},
+    {"shard", required_argument, 0, 's'},
+    {"save-model", required_argument, 0, 'M'},
+    {"sparse", no_argument, 0, 'P'},
+    {"precision", required_argument, 0, 'p'},
+    {"beam", required_argument, 0, 'B'},
+    {"beam-margin", required_argument, 0, 'E'},
+    {"train", required_argument, 0, 'T'},
+    {"frames", required_argument, 0, 'F'},
+    {"channels", required_argument, 0, 'c'},
+    {"channel-output", required_argument, 0, 'C'},
+    {"interleave", no_argument, 0, 'I'},
     {"help", optional_argument, 0, 'h'},
     {0, 0, 0, 0}
   };
@@ -50,8 +74,32 @@ int main(int argc, char **argv) {
 
   char *a_matrix_filename = 0;
   bool output_a_matrix = false;
+  char *map_filename = 0;
+  int brick = 64;
+  int threads = 0;
+  bool occupancy = false;
+  char *labels_filename = 0;
+  bool coarse = false;
+  int coarse_every = 0;
+  bool semi_markov = false;
+  Quantization quantization;
+  bool quantize = false;
+  char *hmm3d_filename = 0;
+  char *hmm3d_binary_filename = 0;
+  char *shard_filename = 0;
+  char *save_model_filename = 0;
+  bool sparse = false;
+  int precision = JSON_PRECISION_DEFAULT;
+  Beam beam;
+  bool validate_beam = false;
+  int train = 0;
+  char *frames_prefix = 0;
+  char *channel_rule = 0;
+  char *channel_filename = 0;
+  bool interleave = false;
+  char *end;
 
-  while ((c = getopt_long(argc, argv, "vd:o:r:ha:", long_options, &long_index)) != -1) {
+  while ((c = getopt_long(argc, argv, "vd:o:r:ha:m:b:j:Ol:c:C:Ig::Sq:k:3:4:s:M:Pp:B:E:T:F:", long_options, &long_index)) != -1) {
     switch (c) {
       case 'a':
         output_a_matrix = true;
@@ -68,13 +116,96 @@ int main(int argc, char **argv) {
       case 'o':
         output_filename = optarg;
         break;
+      case 'm':
+        map_filename = optarg;
+        break;
+      case 'b':
+        brick = atoi(optarg);
+        if (brick <= 0) Die("Brick size must be positive");
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        if (threads < 0) Die("Cannot supply a negative thread count");
+        break;
+      case 'O':
+        occupancy = true;
+        break;
+      case 'l':
+        labels_filename = optarg;
+        break;
+      case 'S':
+        semi_markov = true;
+        break;
+      case 'q':
+        if (!quantization.Parse(optarg)) Die("Unknown quantization '%s'", optarg);
+        quantize = true;
+        break;
+      case 'k':
+        if (atoi(optarg) < 0) Die("Cannot supply a negative minimum count");
+        quantization.min_count = atoi(optarg);
+        quantize = true;
+        break;
+      case '3':
+        hmm3d_filename = optarg;
+        break;
+      case '4':
+        hmm3d_binary_filename = optarg;
+        break;
+      case 's':
+        shard_filename = optarg;
+        break;
+      case 'M':
+        save_model_filename = optarg;
+        break;
+      case 'P':
+        sparse = true;
+        break;
+      case 'p':
+        if (!strcmp(optarg, "shortest")) precision = JSON_PRECISION_SHORTEST;
+        else {
+          precision = atoi(optarg);
+          if (precision < 1 || precision > 17) Die("Precision must be between 1 and 17 digits, or shortest");
+        }
+        break;
+      case 'B':
+        if (atoi(optarg) <= 0) Die("Beam width must be positive");
+        beam.width = atoi(optarg);
+        validate_beam = true;
+        break;
+      case 'E':
+        beam.margin = strtod(optarg, &end);
+        if (end == optarg || *end) Die("Beam margin must be a number");
+        if (beam.margin < 0) Die("Beam margin cannot be negative");
+        validate_beam = true;
+        break;
+      case 'T':
+        train = atoi(optarg);
+        if (train <= 0) Die("Training iterations must be positive");
+        break;
+      case 'F':
+        frames_prefix = optarg;
+        break;
+      case 'g':
+        coarse = true;
+        if (optarg) coarse_every = atoi(optarg);
+        if (coarse_every < 0) Die("Cannot group a negative number of atoms");
+        break;
+      case 'c':
+        channel_rule = optarg;
+        break;
+      case 'C':
+        channel_filename = optarg;
+        break;
+      case 'I':
+        interleave = true;
+        break;
       case 'h':
         Usage();
         break;
       case '?':
         if (optopt == 'a') {
           output_a_matrix = true;
-        } else if (optopt == 'd' || optopt == 'r' || optopt == 'o') {
+        } else if (optopt == 'd' || optopt == 'r' || optopt == 'o' || optopt == 'm' || optopt == 'b' || optopt == 'j' || optopt == 'l' || optopt == 'c' || optopt == 'C' || optopt == 'q' || optopt == 'k' || optopt == '3' || optopt == '4' || optopt == 's' || optopt == 'M' || optopt == 'p' || optopt == 'B' || optopt == 'E' || optopt == 'T' || optopt == 'F') {
           Die("Option -%c requires an argument", optopt);
         } else if (isprint(optopt)) {
           Die("Unknown option '-%c'. Run '%s --help' to see options'", optopt, base);
@@ -94,38 +225,172 @@ int main(int argc, char **argv) {
     optind++;
   }
   if (!filenames.size()) Die("Must supply input filename");
+  if (occupancy && map_filename) Die("--occupancy cannot be combined with --map");
+  if (labels_filename && (occupancy || map_filename)) Die("--labels cannot be combined with --occupancy or --map");
+  if (occupancy && (hmm3d_filename || hmm3d_binary_filename)) Die("--hmm3d cannot be combined with --occupancy");
+  if (train && occupancy) Die("--train cannot be combined with --occupancy");
+  if (validate_beam && occupancy) Die("--beam cannot be combined with --occupancy");
+  if (frames_prefix && (occupancy || map_filename || labels_filename || channel_rule || coarse || semi_markov || quantize || train)) Die("--frames cannot be combined with --occupancy, -m, -l, --channels, -g, --semi-markov, --quantize or --train");
+  if (frames_prefix && (x < y || y < z)) Die("--frames needs dimensions with x >= y >= z");
+  if (train && semi_markov) Die("--train cannot be combined with --semi-markov");
+  if (!channel_rule != !channel_filename) Die("--channels and --channel-output must be given together");
+  if (channel_rule && (occupancy || map_filename || labels_filename || output_filename || output_a_matrix || shard_filename || save_model_filename || hmm3d_filename || hmm3d_binary_filename)) Die("--channels cannot be combined with other outputs");
   MultiPDBVoxelizer mpv;
   for (unsigned i = 0; i < filenames.size(); ++i) {
-    mpv.push_back(PDB::New(filenames[i], values[i]));
+    PDB::Ptr pdb = PDB::New(filenames[i], values[i]);
+    if (coarse) pdb->CoarseGrain(coarse_every);
+    mpv.push_back(pdb);
   }
   mpv.SetDimensions(x, y, z);
   mpv.CalculateSpan();
   mpv.SetRadius(radius);
-  PNG<PNG_FORMAT_GA>::Pixel *voxels = mpv.Voxelize();
+  if (channel_rule) {
+    ChannelVolume::Ptr channels = mpv.VoxelizeChannels(ChannelRule::New(channel_rule));
+    if (!channels->Write(channel_filename, interleave)) Die("Failed to write %s", channel_filename);
+    return 0;
+  }
+  MappedFile::Ptr volume;
+  BitVolume::Ptr bits;
+  PNG<PNG_FORMAT_GA>::Pixel *voxels = nullptr;
+  if (occupancy) bits = mpv.VoxelizeOccupancy();
+  else if (labels_filename) {
+    LabelVolume::Ptr labels = mpv.VoxelizeLabels();
+    if (!labels->Write(labels_filename)) Die("Failed to write %s", labels_filename);
+    voxels = labels->ToPixels();
+  }
+  else if (map_filename) {
+    volume = mpv.VoxelizeOutOfCore(map_filename, brick, threads);
+    voxels = (PNG<PNG_FORMAT_GA>::Pixel *) volume->GetBuffer();
+  } else voxels = mpv.Voxelize();
   PNG<PNG_FORMAT_GA>::Pixel *slice;
   string output_basename;
   if (output_filename) {
     output_basename = output_filename;
     for (int k = 0; k < z; ++k) {
-      slice = ZSlice(voxels, x, y, k);
+      slice = bits ? ZSlice(bits, k) : ZSlice(voxels, x, y, k);
       PNG<PNG_FORMAT_GA> img (x, y, slice);
       if (!img.Write(output_basename + to_string(k) + ".png")) {
         Die("Failed to write %s", (output_basename + to_string(k) + ".png").c_str());
       }
     }
   }
+  HMMCounts counts[6];
+  if (output_a_matrix || shard_filename || save_model_filename || validate_beam) {
+    size_t coords[] = { (size_t) x, (size_t) y, (size_t) z };
+    if (bits) CountHMMGroup(bits, counts);
+    else CountHMMGroup(voxels, coords, threads, counts);
+    if (shard_filename && !WriteShard(shard_filename, counts)) Die("Failed to write %s", shard_filename);
+  }
+  if (quantize && (output_a_matrix || save_model_filename || validate_beam)) {
+    const char axes[] = "xyz";
+    for (int m = 0; m < 6; ++m) {
+      size_t before = counts[m].states.size();
+      counts[m] = counts[m].Quantize(quantization);
+      if (!(m % 2)) fprintf(stderr, "%c: quantized %zu states to %zu\n", axes[m/2], before, counts[m].states.size());
+    }
+  }
+  HMMGroup::Ptr group;
+  HMM::Ptr models[6];
+  if (output_a_matrix || save_model_filename || validate_beam) {
+    group = HMMGroup::FromCounts(counts);
+    HMM::Ptr all[] = { group->xpos, group->xneg, group->ypos, group->yneg, group->zpos, group->zneg };
+    copy(all, all + 6, models);
+  }
+  if (train && group) {
+    size_t coords[] = { (size_t) x, (size_t) y, (size_t) z };
+    for (int m = 0; m < 6; ++m) {
+      vector<HMM::Observation> obs;
+      vector<size_t> offsets;
+      RunSequences(voxels, coords, m/2, m % 2, obs, offsets);
+      SeedRunEmissions(models[m]);
+      size_t impossible = 0;
+      double loglik = BaumWelch(models[m], obs, offsets, train, threads, &impossible);
+      fprintf(stderr, "%s: log likelihood %g after %d Baum-Welch iterations, %zu of %zu lines impossible\n", directions[m], loglik, train, impossible, offsets.size() - 1);
+    }
+  }
+  if (save_model_filename && !WriteModel(save_model_filename, group)) Die("Failed to write %s", save_model_filename);
+  HSMMGroup::Ptr hsmm;
   if (output_a_matrix) {
+    int fd = a_matrix_filename ? open(a_matrix_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+    if (fd < 0) Die("Failed to open %s", a_matrix_filename);
+    JsonWriter out(fd);
+    out.SetSparse(sparse);
+    out.SetPrecision(precision);
+    if (semi_markov) {
+      hsmm = HSMMGroup::FromCounts(counts);
+      hsmm->Write(out);
+    } else group->Write(out);
+    if (!a_matrix_filename) out.Raw("\n");
+    if (!out.Flush()) Die("Failed to write the a-matrix");
+    if (a_matrix_filename) close(fd);
+  }
+  if (hsmm && voxels && !quantize) {
     size_t coords[] = { (size_t) x, (size_t) y, (size_t) z };
-    shared_ptr<json_object> json_obj (CalculateHMMGroup(voxels, coords)->as_json_object(), &::json_object_put);
-    if (a_matrix_filename) {
-      const char *json = json_object_to_json_string(json_obj.get());
-      ofstream out(a_matrix_filename);
-      out << json;
-      out.close();
-    } else {
-      printf("%s\n", json_object_to_json_string(json_obj.get()));
+    HSMM::Ptr hsmms[] = { hsmm->xpos, hsmm->xneg, hsmm->ypos, hsmm->yneg, hsmm->zpos, hsmm->zneg };
+    for (int m = 0; m < 6; ++m) {
+      vector<HMM::Observation> obs;
+      vector<size_t> offsets;
+      LineSequences(voxels, coords, m/2, m % 2, false, obs, offsets);
+      SeedRunEmissions(hsmms[m]);
+      size_t impossible = 0;
+      double loglik = ScoreHSMM(hsmms[m], obs, offsets, &impossible);
+      fprintf(stderr, "%s: semi-Markov log likelihood %g, %zu of %zu lines impossible\n", directions[m], loglik, impossible, offsets.size() - 1);
+    }
+  }
+  if (validate_beam) {
+    size_t coords[] = { (size_t) x, (size_t) y, (size_t) z };
+    for (int m = 0; m < 6; ++m) {
+      vector<HMM::Observation> obs;
+      vector<size_t> offsets;
+      if (models[m]->emit.empty()) SeedRunEmissions(models[m]);
+      RunSequences(voxels, coords, m/2, m % 2, obs, offsets);
+      BeamReport report = ValidateBeam(models[m], obs, offsets, beam, threads);
+      fprintf(stderr, "%s: beam dropped the best path on %zu of %zu lines (%.1fms exact, %.1fms beam)\n", directions[m], report.misses, report.sequences, 1000*report.exact_seconds, 1000*report.beam_seconds);
+    }
+  }
+  if (hmm3d_filename || hmm3d_binary_filename) {
+    size_t coords[] = { (size_t) x, (size_t) y, (size_t) z };
+    HMM3D::Ptr hmm = Calculate3DHMM(voxels, coords, threads);
+    if (hmm3d_filename) {
+      int fd = open(hmm3d_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) Die("Failed to open %s", hmm3d_filename);
+      JsonWriter out(fd);
+      out.SetPrecision(precision);
+      WriteHMM3D(out, hmm);
+      if (!out.Flush()) Die("Failed to write %s", hmm3d_filename);
+      close(fd);
+    }
+    if (hmm3d_binary_filename && !WriteModel(hmm3d_binary_filename, hmm)) Die("Failed to write %s", hmm3d_binary_filename);
+  }
+  if (frames_prefix) {
+    size_t coords[] = { (size_t) x, (size_t) y, (size_t) z };
+    IncrementalHMMGroup::Ptr models = IncrementalHMMGroup::New(voxels, coords);
+    for (int frame = 1; mpv.NextFrame(); ++frame) {
+      PNG<PNG_FORMAT_GA>::Pixel *next = mpv.Voxelize();
+      vector<array<size_t, 3> > changed;
+      for (size_t i = 0; i < (size_t) x; ++i) {
+        for (size_t j = 0; j < (size_t) y; ++j) {
+          for (size_t k = 0; k < (size_t) z; ++k) {
+            size_t m = i*x*y + j*y + k;
+            if (next[m].GetValue() != voxels[m].GetValue()) changed.push_back({{ i, j, k }});
+          }
+        }
+      }
+      delete[] voxels;
+      voxels = next;
+      models->Update(voxels, changed);
+      string filename = string(frames_prefix) + to_string(frame) + ".json";
+      int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) Die("Failed to open %s", filename.c_str());
+      JsonWriter out(fd);
+      out.SetSparse(sparse);
+      out.SetPrecision(precision);
+      models->Build()->Write(out);
+      if (!out.Flush()) Die("Failed to write %s", filename.c_str());
+      close(fd);
+      fprintf(stderr, "frame %d: %zu voxels changed\n", frame, changed.size());
     }
   }
-  delete[] voxels;
+  if (!volume) delete[] voxels;
   return 0;
 } 
@@ -13,6 +13,15 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <tuple>
+#include <array>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <png.h>
 #include <libgen.h>
 #include <json-c/json.h>
@@ -88,6 +97,28 @@ template <typename T> void Die(T);
 
 void Usage();
 
+class MappedFile {
+  int fd;
+  void *data;
+  size_t len;
+  bool created;
+  public:
+    typedef shared_ptr<MappedFile> Ptr;
+    static Ptr New(const char *, size_t);
+    static Ptr Open(const char *);
+    MappedFile(const char *, size_t);
+    MappedFile(const char *);
+    ~MappedFile();
+    void *GetBuffer();
+    size_t GetSize();
+    bool WasCreated();
+    void Sync();
+    void Sync(size_t offset, size_t length);
+};
+
+#define BRICK_CHECKPOINT_INTERVAL 64
+#define VOXELIZE_SLAB_VOXELS ((size_t) 1 << 22)
+
 class PDB {
   friend class MultiPDBVoxelizer;
   molfile_timestep_t ts;
@@ -97,31 +128,156 @@ class PDB {
   float xmin, xmax, ymin, ymax, zmin, zmax;
   void *handle;
   uint8_t density;
+  bool coarse;
+  float Radius(int l) { return coarse ? atoms[l].radius : get_pte_vdw_radius(atoms[l].atomicnumber); }
   public:
     typedef shared_ptr<PDB> Ptr;
     static Ptr New(char *, uint8_t);
     PDB(char *, uint8_t);
     ~PDB();
+    void CoarseGrain(int every);
+    bool NextFrame();
+};
+
+struct BitVolume {
+  typedef shared_ptr<BitVolume> Ptr;
+  static Ptr New(size_t, size_t, size_t, uint8_t);
+  BitVolume(size_t, size_t, size_t, uint8_t);
+  size_t x, y, z, words;
+  uint8_t value;
+  vector<uint64_t> bits;
+  uint64_t *Line(size_t i, size_t j) { return &bits[(i*y + j)*words]; }
+  bool Get(size_t i, size_t j, size_t k) { return (Line(i, j)[k/64] >> (k % 64)) & 1; }
+  void Set(size_t i, size_t j, size_t k) { Line(i, j)[k/64] |= (uint64_t) 1 << (k % 64); }
+  uint64_t Mask(size_t w);
+};
+
+struct LabelVolume {
+  typedef uint16_t Label;
+  typedef shared_ptr<LabelVolume> Ptr;
+  static Ptr New(size_t, size_t, size_t);
+  LabelVolume(size_t, size_t, size_t);
+  size_t x, y, z;
+  vector<Label> labels;
+  vector<uint8_t> palette;
+  Label Get(size_t i, size_t j, size_t k) { return labels[(i*y + j)*z + k]; }
+  PNG<PNG_FORMAT_GA>::Pixel GetPixel(size_t i, size_t j, size_t k) {
+    Label l = Get(i, j, k);
+    if (!l) return { 0, 0 };
+    return { palette[l], 0xff };
+  }
+  PNG<PNG_FORMAT_GA>::Pixel *ToPixels();
+  int Write(const char *filename);
+};
+
+class ChannelRule {
+  enum class Kind {
+    Chain, Element, Residue
+  };
+  Kind kind;
+  map<string, size_t> index;
+  string Key(const molfile_atom_t &);
+  public:
+    typedef shared_ptr<ChannelRule> Ptr;
+    static Ptr New(const char *);
+    ChannelRule(const char *);
+    vector<string> names;
+    void Learn(const molfile_atom_t &);
+    size_t Lookup(const molfile_atom_t &);
+};
+
+struct ChannelVolume {
+  typedef shared_ptr<ChannelVolume> Ptr;
+  static Ptr New(size_t, size_t, size_t, size_t);
+  ChannelVolume(size_t, size_t, size_t, size_t);
+  size_t x, y, z, channels;
+  vector<string> names;
+  vector<uint8_t> data;
+  int Write(const char *filename, bool interleaved);
 };
 
 class MultiPDBVoxelizer {
   float xmin, xmax, ymin, ymax, zmin, zmax, xdiff, ydiff, zdiff, xadj, yadj, zadj, maxdim;
   double xratio, yratio, zratio, step, radius, vradius;
-  int x, y, z, a, v, maxpxl;
+  int x, y, z, maxpxl;
+  size_t a, v;
   int xoffset, yoffset, zoffset;
   vector<PDB::Ptr> pdbs;
+  bool Covers(PDB *p, int l, int i, int j, int k);
+  uint64_t Fingerprint();
+  bool AtomBounds(PDB *p, int l, int *lo, int *hi);
+  void ResolveLabels(LabelVolume::Label *out, const vector<pair<uint32_t, uint32_t>> &atoms, int *lo, int *hi, ChannelRule *rule = nullptr);
+  void VoxelizeBrick(PNG<PNG_FORMAT_GA>::Pixel *out, const vector<pair<uint32_t, uint32_t>> &atoms, int *lo, int *hi);
   public:
     void SetRadius(double r);
     void SetDimensions(int i, int j, int k);
     void push_back(PDB::Ptr);
+    bool NextFrame();
     void CalculateSpan();
     PNG<PNG_FORMAT_GA>::Pixel *Voxelize();
+    MappedFile::Ptr VoxelizeOutOfCore(const char *filename, int brick, int threads);
+    BitVolume::Ptr VoxelizeOccupancy();
+    LabelVolume::Ptr VoxelizeLabels();
+    ChannelVolume::Ptr VoxelizeChannels(ChannelRule::Ptr rule);
 };
 
 template <typename T> void ParseFilename(char *fn, vector<char *> &filenames, vector<T> &values);
 
 json_object *NewDoubleOrInt(double d);
 
+// Writes JSON straight to a file descriptor through a fixed buffer, spaced
+// exactly like json_object_to_json_string, so large models never exist as a
+// json-c tree or as one big string.
+class JsonWriter {
+  int fd;
+  bool failed;
+  bool keyed;
+  bool sparse;
+  int precision;
+  size_t used;
+  vector<bool> children;
+  char buffer[1 << 16];
+  void Put(const char *s, size_t n);
+  void Put(const char *s);
+  void Value();
+  public:
+    JsonWriter(int fd);
+    ~JsonWriter();
+    void BeginObject();
+    void EndObject();
+    void Key(const char *);
+    void BeginArray();
+    void EndArray();
+    void Int(long long);
+    void Double(double);
+    void DoubleOrInt(double);
+    void Raw(const char *);
+    int Flush();
+    void SetSparse(bool);
+    bool IsSparse();
+    void SetPrecision(int);
+};
+
+// Precision for JsonWriter doubles: json-c's %.17g by default, the fewest
+// digits that still read back to the same double, or a fixed number of
+// significant digits (1-17).
+#define JSON_PRECISION_DEFAULT -1
+#define JSON_PRECISION_SHORTEST 0
+
+// Compressed sparse rows: the entries of row i are columns/values in
+// [offsets[i], offsets[i + 1]), sorted by column.
+struct SparseMatrix {
+  typedef tuple<size_t, size_t, double> Entry;
+  SparseMatrix();
+  size_t rows, cols;
+  vector<size_t> offsets;
+  vector<uint32_t> columns;
+  vector<double> values;
+  void Assign(size_t r, size_t c, vector<Entry> &entries);
+  double Get(size_t i, size_t j) const;
+  void Normalize();
+};
+
 struct HMM {
   typedef pair<uint8_t, size_t> State;
   typedef pair<State, State> Transition;
@@ -130,17 +286,22 @@ struct HMM {
   static Ptr New();
   vector<Observation> obs;
   vector<State> states;
-  vector<double> matrix;
+  SparseMatrix matrix;
   vector<double> emit;
-  vector<double> initial;
+  SparseMatrix initial;
   json_object *as_json_object();
+  void Write(JsonWriter &);
 };
 
+struct HMMCounts;
+
 struct HMMGroup {
   typedef shared_ptr<HMMGroup> Ptr;
   static Ptr New();
+  static Ptr FromCounts(HMMCounts *);
   HMM::Ptr xpos, xneg, ypos, yneg, zpos, zneg;
   json_object *as_json_object();
+  void Write(JsonWriter &);
 };
 
 void IncreaseOrDecrease(size_t &n, uint8_t sign);
@@ -149,6 +310,109 @@ template <typename T> HMM::Ptr CalculateHMM(T *items, size_t *coords, uint8_t fi
 
 template <typename T> HMMGroup::Ptr CalculateHMMGroup(T *items, size_t *dimensions);
 
+template <typename T> HMMGroup::Ptr CalculateHMMGroup(T *items, size_t *dimensions, int threads);
+
+// How HMMCounts::Quantize coarsens the state space. Durations are binned
+// into log-spaced bins (1, 2-3, 4-7, ... for base 2) or into per-density
+// quantiles of the run counts, each bin represented by its shortest
+// duration; states still seen fewer than min_count times are then folded
+// into the nearest kept duration of the same density.
+struct Quantization {
+  enum Mode { None, Log, Quantile };
+  Mode mode;
+  double base;
+  size_t bins;
+  size_t min_count;
+  Quantization() : mode(None), base(2), bins(16), min_count(0) {}
+  bool Parse(const char *spec);
+};
+
+struct HMMCounts {
+  struct StateHash {
+    size_t operator()(const HMM::State &s) const { return hash<size_t>()(s.second*257 + s.first); }
+  };
+  struct TransitionHash {
+    size_t operator()(const HMM::Transition &t) const { return StateHash()(t.first)*31 + StateHash()(t.second); }
+  };
+  unordered_map<HMM::State, size_t, StateHash> states;
+  unordered_map<HMM::State, size_t, StateHash> initial;
+  unordered_map<HMM::Transition, size_t, TransitionHash> transitions;
+  void AddState(const HMM::State &, size_t n = 1);
+  void AddInitial(const HMM::State &, size_t n = 1);
+  void AddTransition(const HMM::State &, const HMM::State &, size_t n = 1);
+  void Merge(const HMMCounts &);
+  HMMCounts Quantize(const Quantization &) const;
+  HMM::Ptr Build();
+};
+
+HMM::Ptr CalculateHMM(BitVolume::Ptr items, uint8_t fix, uint8_t sign);
+
+HMMGroup::Ptr CalculateHMMGroup(BitVolume::Ptr items);
+
+template <typename T> void CountHMMGroup(T *items, size_t *dimensions, int threads, HMMCounts *counts);
+
+void CountHMMGroup(BitVolume::Ptr items, HMMCounts *counts);
+
+// Keeps the run decomposition of every line of a volume together with the
+// counts of all six directions, so that when a few voxels change only the
+// lines through them are rescanned and their old counts swapped for new
+// ones. The counts always match what CountHMMGroup gives for the current
+// voxels; Build normalizes them on demand. The volume must have x >= y >= z,
+// the shapes where the i*x*y + j*y + k layout gives every voxel its own
+// offset.
+class IncrementalHMMGroup {
+  size_t dimensions[3];
+  vector<vector<HMM::State> > lines[3];
+  HMMCounts counts[6];
+  void Apply(int axis, const vector<HMM::State> &runs, int sign);
+  template <typename T> void Scan(T *items, int axis, size_t line);
+  public:
+    typedef shared_ptr<IncrementalHMMGroup> Ptr;
+    template <typename T> static Ptr New(T *items, size_t *dimensions);
+    template <typename T> void Update(T *items, const vector<array<size_t, 3> > &changed);
+    HMMCounts *GetCounts();
+    HMMGroup::Ptr Build();
+};
+
+// Hidden semi-Markov model over density states. A run is one visit to a
+// state whose length is drawn from that state's duration distribution, so
+// durations no longer multiply the state space.
+struct HSMM {
+  typedef uint8_t State;
+  typedef uint8_t Observation;
+  typedef shared_ptr<HSMM> Ptr;
+  static Ptr New();
+  static Ptr FromCounts(const HMMCounts &);
+  vector<State> states;
+  vector<double> matrix;
+  vector<double> initial;
+  size_t max_duration;
+  vector<double> duration;
+  vector<Observation> obs;
+  vector<double> emit;
+  json_object *as_json_object();
+  void Write(JsonWriter &);
+};
+
+struct HSMMGroup {
+  typedef shared_ptr<HSMMGroup> Ptr;
+  static Ptr New();
+  static Ptr FromCounts(HMMCounts *);
+  HSMM::Ptr xpos, xneg, ypos, yneg, zpos, zneg;
+  json_object *as_json_object();
+  void Write(JsonWriter &);
+};
+
+template <typename T> void CountHMM(T *items, size_t *coords, uint8_t fix, uint8_t sign, HMMCounts &counts);
+
+template <typename T> HSMM::Ptr CalculateHSMM(T *items, size_t *coords, uint8_t fix, uint8_t sign);
+
+double ViterbiHSMM(HSMM::Ptr m, const vector<HMM::Observation> &obs, vector<HMM::State> &path);
+
+double ScoreHSMM(HSMM::Ptr m, const vector<HMM::Observation> &obs, const vector<size_t> &offsets, size_t *impossible);
+
+PNG<PNG_FORMAT_GA>::Pixel *ZSlice(BitVolume::Ptr values, size_t z);
+
 #define INDEX(it) (distance(it.begin(), it))
 
 struct ViterbiResult {
@@ -206,6 +470,7 @@ struct HMM3D {
   map<PartialState, size_t> state_map;
   vector<Observation> xobs;
   vector<Observation> yobs;
+  vector<Observation> zobs;
   vector<double> xtransition;
   vector<double> xinitial;
   vector<double> ytransition;
@@ -215,6 +480,23 @@ struct HMM3D {
   void Rotate(double, double);
 };
 
+// Per-axis voxel-to-voxel counts for HMM3D, indexed by the byte state like
+// HMM2DCounts. Axis 0 is x (the outermost index of the Pixel grid).
+struct HMM3DCounts {
+  typedef shared_ptr<HMM3DCounts> Ptr;
+  static Ptr New();
+  uint64_t seen[256];
+  uint64_t initial[3][256];
+  uint64_t transition[3][256][256];
+  void Merge(const HMM3DCounts &);
+  HMM3D::Ptr Build();
+};
+
+template <typename T> void Count3DHMM(T *items, size_t *dimensions, size_t i0, size_t i1, HMM3DCounts *counts);
+template <typename T> HMM3D::Ptr Calculate3DHMM(T *items, size_t *dimensions);
+template <typename T> HMM3D::Ptr Calculate3DHMM(T *items, size_t *dimensions, int threads);
+void WriteHMM3D(JsonWriter &, HMM3D::Ptr);
+
 struct Permutation {
   vector<Permutation *> last;
   HMM2D::PartialState state;
@@ -232,7 +514,45 @@ struct Viterbi2DResult {
   double probability;
 };
 
-ViterbiResult *Viterbi(HMM::Ptr m, const vector<HMM::Observation> &, size_t len, HMM::State *s, ViterbiResult *last);
+// An HMM flattened for decoding by index: states are uint32_t ids into its
+// states, observations ids into its obs, and every probability is a log.
+// Transitions are kept by column, the predecessors of state j being
+// rows[starts[j]..starts[j + 1]), and also as a dense column-major matrix
+// for the max-plus kernel when at least a quarter of it is nonzero. emit is
+// n x nobs, or empty when every observation is equally likely.
+struct ViterbiModel {
+  typedef shared_ptr<ViterbiModel> Ptr;
+  static Ptr New(const HMM &);
+  uint32_t n, nobs;
+  vector<size_t> starts;
+  vector<uint32_t> rows;
+  vector<double> values, columns, initial, emit;
+  uint32_t obs_ids[256];
+};
+
+#define VITERBI_ANY_END ((uint32_t) -1)
+
+// Viterbi over a ViterbiModel. The score rows and backpointers are kept
+// between calls, so once they have grown to the longest sequence decoding
+// allocates nothing. Decode writes T state ids to path, finishing in end
+// unless it is VITERBI_ANY_END, and returns the log probability of the path
+// (-infinity if there is none, path then being meaningless).
+class ViterbiDecoder {
+  ViterbiModel::Ptr model;
+  vector<double> delta, next, checkpoints;
+  vector<uint32_t> back;
+  void Step(const HMM::Observation *obs, size_t t, uint32_t *from);
+  public:
+    ViterbiDecoder(ViterbiModel::Ptr);
+    double Decode(const HMM::Observation *obs, size_t T, uint32_t *path, uint32_t end = VITERBI_ANY_END);
+};
+
+// Bytes the backpointer table of ViterbiDecoder may take before it switches
+// to checkpointed decoding.
+#define VITERBI_MEMORY_BUDGET ((size_t) 256 << 20)
+extern size_t viterbi_memory_budget;
+
+double ViterbiPath(HMM::Ptr m, const vector<HMM::Observation> &, size_t len, vector<uint32_t> &path, const HMM::State *end);
 
 ViterbiResult *Viterbi(HMM::Ptr m, const vector<HMM::Observation> &, size_t len, HMM::State *s, ViterbiResult *last);
 
@@ -240,6 +560,47 @@ ViterbiResult *ViterbiMax(HMM::Ptr m, vector<HMM::Observation> &);
 
 ViterbiResult *ViterbiMax(HMM::Ptr m, const vector<HMM::Observation> &, size_t len, ViterbiResult *last);
 
+#define VITERBI_LANES 4
+
+// Decodes many sequences against one model, VITERBI_LANES at a time with the
+// SIMD lanes running across sequences, over threads. Sequence s is
+// obs[offsets[s]..offsets[s + 1]); its state ids go to the same range of
+// paths and its log probability to scores[s]. An empty sequence scores 0; one
+// scored -infinity has no possible path and its entries are meaningless.
+void ViterbiBatch(const HMM &m, const HMM::Observation *obs, const size_t *offsets, size_t count, uint32_t *paths, double *scores, int threads);
+
+// Limits of beam-pruned decoding: at most width states survive a step (0 for
+// no limit), and none scoring more than margin below the step's best.
+struct Beam {
+  size_t width;
+  double margin;
+  Beam() : width(0), margin(numeric_limits<double>::infinity()) {}
+};
+
+// How a beam did against exact decoding: misses counts the sequences whose
+// best path the pruning dropped.
+struct BeamReport {
+  size_t sequences, misses;
+  double exact_seconds, beam_seconds;
+};
+
+double ViterbiBeam(HMM::Ptr m, const vector<HMM::Observation> &, size_t len, const Beam &, vector<uint32_t> &path);
+
+BeamReport ValidateBeam(HMM::Ptr m, const vector<HMM::Observation> &obs, const vector<size_t> &offsets, const Beam &, int threads);
+
+double ForwardBackward(const HMM &m, const HMM::Observation *obs, size_t T, vector<double> &alpha, vector<double> &beta, vector<double> &scale);
+
+#define BAUM_WELCH_CHUNK 64
+
+double BaumWelch(HMM::Ptr m, const vector<HMM::Observation> &obs, const vector<size_t> &offsets, int iterations, int threads, size_t *impossible);
+
+void SeedRunEmissions(HMM::Ptr m);
+
+void SeedRunEmissions(HSMM::Ptr m);
+
+template <typename T> void LineSequences(T *items, size_t *dimensions, int axis, bool backward, bool runs, vector<HMM::Observation> &obs, vector<size_t> &offsets);
+template <typename T> void RunSequences(T *items, size_t *dimensions, int axis, bool backward, vector<HMM::Observation> &obs, vector<size_t> &offsets);
+
 json_object *StateToJsonObject(HMM::State s);
 
 void PrintViterbiResult(ViterbiResult *vr);
@@ -249,8 +610,39 @@ Permutation *EMMax(HMM2D::Ptr a, HMM2D::Direction d, size_t len, double threshol
 void WriteCircle(int x, int y, const char *filename);
 void WriteTriangle(int x, int y, const char *filename);
 json_object *HMM2DToJsonObject(HMM2D::Ptr);
+void WriteHMM2D(JsonWriter &, HMM2D::Ptr);
+// Fixed-size count tables for the 2D builders. A PartialState is a byte, so
+// every count lands in a flat 256-wide array and states are only looked up
+// once, when the observed ones are compacted. One image is counted in
+// uint32_t; totals merged from many count shards need uint64_t.
+template <typename C> struct Counts2D {
+  typedef shared_ptr<Counts2D> Ptr;
+  static Ptr New();
+  C seen[256];
+  C xinitial[256];
+  C yinitial[256];
+  C xtransition[256][256];
+  C ytransition[256][256];
+  HMM2D::Ptr Build(bool whole);
+};
+typedef Counts2D<uint32_t> HMM2DCounts;
+typedef Counts2D<uint64_t> HMM2DTotals;
+template <typename T> void Count2DHMM(T *items, size_t *coords, bool reverse, HMM2DCounts *counts);
 template <typename T> HMM2D::Ptr Calculate2DHMM(T *items, size_t *coords);
 HMM2D::Ptr Calculate2DHMMReverse(PNG<PNG_FORMAT_GA>::Pixel *items, size_t *coords);
+// Raw count shards for training one model over many structures. A shard is
+// a header followed by sections of fixed-width records sorted by key (the
+// key as big-endian bytes, then a uint64 count), so any number of shards
+// can be summed in one streaming k-way pass and normalized once at the end.
+#define SHARD_RUNS 1
+#define SHARD_2D 2
+
+int WriteShard(const char *filename, HMMCounts *counts);
+int WriteShard(const char *filename, HMM2DCounts *counts);
+int ShardKind(const char *filename);
+int ReadShard(const char *filename, HMMCounts *counts);
+int ReadShard(const char *filename, HMM2DTotals *counts);
+int MergeShards(const char *output, const vector<char *> &inputs);
 template <int format> void GenProjections(PNG<format> *, vector<HMM2D::Observation> &, vector<HMM2D::Observation> &);
 Viterbi2DResult *Viterbi2DMax(HMM2D::Ptr, size_t);
 Viterbi2DResult *Viterbi2D(HMM2D::Ptr, size_t, HMM2D::PartialState);
@@ -272,4 +664,45 @@ Permutation *EMFrontImpl(HMM2D::Ptr a, HMM2D::Direction d, HMM2D::PartialState l
 double SumThe2DState(HMM2D::State &state);
 void ForeachProbableCombinationOfLength(HMM2D::Ptr a, HMM2D::Direction d, size_t len, function<void(HMM2D::State &, double &)> fn, double threshold);
 hmm2d_t *HMM2DToC(HMM2D::Ptr a);
+
+// Versioned binary model file laid out for mmap: a 64-byte header, a table
+// of blocks, then each block's payload at a 64-byte aligned offset. A block
+// is tagged with what it holds and the direction it belongs to (0-5 for
+// xpos..zneg of an HMMGroup, 0-1 for x and y of an HMM2D, 0-2 for x, y
+// and z of an HMM3D).
+#define MODEL_VERSION 1
+#define MODEL_HMM_GROUP 1
+#define MODEL_HMM2D 2
+#define MODEL_HMM3D 3
+
+struct ModelHeader {
+  char magic[8];
+  uint32_t version, kind;
+  uint32_t blocks, long_double_size;
+  char reserved[40];
+};
+
+struct ModelBlock {
+  enum Type : uint32_t { Density = 1, Duration, Offsets, Columns, Values, Dense, Initial, States, Observations };
+  uint32_t type, direction;
+  uint64_t offset, count, size;
+};
+
+class ModelFile {
+  MappedFile::Ptr file;
+  const ModelHeader *header;
+  const ModelBlock *blocks;
+  const ModelBlock &Find(uint32_t type, uint32_t direction);
+  const void *Payload(uint32_t type, uint32_t direction, uint64_t count, uint64_t width);
+  public:
+    typedef shared_ptr<ModelFile> Ptr;
+    static Ptr Open(const char *filename);
+    uint32_t GetKind();
+    hmm2d_t *GetHMM2D();
+};
+
+int WriteModel(const char *filename, HMMGroup::Ptr group);
+int WriteModel(const char *filename, HMM2D::Ptr hmm);
+int WriteModel(const char *filename, HMM3D::Ptr hmm);
+void FreeHMM2DView(hmm2d_t *hmm);
 #endif